@@ -0,0 +1,413 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define NO_SLOT -1
+//most misses of cache_readv read from the disk at once
+#define MISS_BATCH 256
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+typedef struct cacheEntry{
+    size_t block;
+    bool dirty;
+    //neighbours in the LRU list
+    int prev;
+    int next;
+}cEntry;
+
+struct blockCache{
+    //disk the blocks belong to
+    struct disk *disk;
+    //0 if every request goes straight to the disk
+    size_t capacity;
+    size_t used;
+    //most and least recently used slot
+    int head;
+    int tail;
+    cEntry *entries;
+    char *data;
+    //disk block -> slot holding it, NO_SLOT if not cached
+    int *slotOf;
+    //dirty blocks and their data, filled by cache_flush
+    size_t *flushBlocks;
+    void **flushBufs;
+    //staging area of cache_prefetch, CACHE_PREFETCH_MAX blocks
+    char *prefetchBuf;
+    //protects everything above, misses are
+    //read from the disk without holding it
+    pthread_mutex_t lock;
+    //held by cache_prefetch while it uses prefetchBuf,
+    //taken before lock
+    pthread_mutex_t prefetchLock;
+};
+
+bCache *cache_create(struct disk *d, size_t capacity, size_t numBlock)
+{
+    bCache *cache = calloc(1, sizeof(bCache));
+    if(!cache)
+        die_perror("calloc");
+    cache->disk = d;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->prefetchLock, NULL);
+    if(!capacity)
+        return cache;
+
+    cEntry *entries = malloc(capacity * sizeof(cEntry));
+    char *data = malloc(capacity * BLOCK_SIZE);
+    int *slotOf = malloc(numBlock * sizeof(int));
+    size_t *flushBlocks = malloc(capacity * sizeof(size_t));
+    void **flushBufs = malloc(capacity * sizeof(void *));
+    char *prefetchBuf = malloc(CACHE_PREFETCH_MAX * BLOCK_SIZE);
+    if(!entries || !data || !slotOf || !flushBlocks || !flushBufs || !prefetchBuf)
+        die_perror("malloc");
+
+    for (size_t i = 0; i < numBlock; ++i)
+        slotOf[i] = NO_SLOT;
+
+    cache->capacity = capacity;
+    cache->used = 0;
+    cache->head = NO_SLOT;
+    cache->tail = NO_SLOT;
+    cache->entries = entries;
+    cache->data = data;
+    cache->slotOf = slotOf;
+    cache->flushBlocks = flushBlocks;
+    cache->flushBufs = flushBufs;
+    cache->prefetchBuf = prefetchBuf;
+    return cache;
+}
+
+void cache_destroy(bCache *cache)
+{
+    if(!cache)
+        return;
+    free(cache->entries);
+    free(cache->data);
+    free(cache->slotOf);
+    free(cache->flushBlocks);
+    free(cache->flushBufs);
+    free(cache->prefetchBuf);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_mutex_destroy(&cache->prefetchLock);
+    free(cache);
+}
+
+static void *slot_data(bCache *cache, int slot)
+{
+    return cache->data + (size_t)slot * BLOCK_SIZE;
+}
+
+static void lru_unlink(bCache *cache, int slot)
+{
+    cEntry *e = &cache->entries[slot];
+    if(e->prev != NO_SLOT)
+        cache->entries[e->prev].next = e->next;
+    else
+        cache->head = e->next;
+    if(e->next != NO_SLOT)
+        cache->entries[e->next].prev = e->prev;
+    else
+        cache->tail = e->prev;
+}
+
+static void lru_push_front(bCache *cache, int slot)
+{
+    cEntry *e = &cache->entries[slot];
+    e->prev = NO_SLOT;
+    e->next = cache->head;
+    if(cache->head != NO_SLOT)
+        cache->entries[cache->head].prev = slot;
+    cache->head = slot;
+    if(cache->tail == NO_SLOT)
+        cache->tail = slot;
+}
+
+/*
+ * return a slot for @block, either a never used one
+ * or the least recently used one after writing it
+ * back if it is dirty. The slot is not linked in
+ * the LRU list yet.
+ *
+ * return NO_SLOT if the victim could not be written back
+ */
+static int get_victim(bCache *cache)
+{
+    if(cache->used < cache->capacity)
+        return cache->used++;
+
+    int slot = cache->tail;
+    cEntry *e = &cache->entries[slot];
+    if(e->dirty){
+        if(bdisk_write(cache->disk, e->block, slot_data(cache, slot)))
+            return NO_SLOT;
+        e->dirty = false;
+    }
+    lru_unlink(cache, slot);
+    cache->slotOf[e->block] = NO_SLOT;
+    return slot;
+}
+
+int cache_read(bCache *cache, size_t block, void *buf)
+{
+    if(!cache->capacity)
+        return bdisk_read(cache->disk, block, buf);
+
+    pthread_mutex_lock(&cache->lock);
+    int slot = cache->slotOf[block];
+    if(slot != NO_SLOT){
+        lru_unlink(cache, slot);
+        lru_push_front(cache, slot);
+        memcpy(buf, slot_data(cache, slot), BLOCK_SIZE);
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if(bdisk_read(cache->disk, block, buf))
+        return -1;
+
+    //another reader may have brought it in meanwhile
+    pthread_mutex_lock(&cache->lock);
+    if(cache->slotOf[block] == NO_SLOT){
+        slot = get_victim(cache);
+        if(slot != NO_SLOT){
+            cache->entries[slot].block = block;
+            cache->entries[slot].dirty = false;
+            cache->slotOf[block] = slot;
+            lru_push_front(cache, slot);
+            memcpy(slot_data(cache, slot), buf, BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+int cache_write(bCache *cache, size_t block, const void *buf)
+{
+    if(!cache->capacity)
+        return bdisk_write(cache->disk, block, buf);
+
+    pthread_mutex_lock(&cache->lock);
+    int slot = cache->slotOf[block];
+    if(slot != NO_SLOT){
+        lru_unlink(cache, slot);
+    } else {
+        slot = get_victim(cache);
+        if(slot == NO_SLOT){
+            pthread_mutex_unlock(&cache->lock);
+            return -1;
+        }
+        cache->entries[slot].block = block;
+        cache->slotOf[block] = slot;
+    }
+    cache->entries[slot].dirty = true;
+    lru_push_front(cache, slot);
+    memcpy(slot_data(cache, slot), buf, BLOCK_SIZE);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+int cache_readv(bCache *cache, const size_t *blocks, void *const *bufs,
+                size_t count)
+{
+    if(!cache->capacity)
+        return bdisk_readv(cache->disk, blocks, bufs, count);
+
+    //hits are copied under the lock, the misses
+    //are then read together without holding it
+    size_t missBlocks[MISS_BATCH];
+    void *missBufs[MISS_BATCH];
+    size_t i = 0;
+    while(i < count){
+        size_t numMiss = 0;
+        pthread_mutex_lock(&cache->lock);
+        for (; i < count && numMiss < MISS_BATCH; ++i) {
+            int slot = cache->slotOf[blocks[i]];
+            if(slot != NO_SLOT){
+                memcpy(bufs[i], slot_data(cache, slot), BLOCK_SIZE);
+                continue;
+            }
+            missBlocks[numMiss] = blocks[i];
+            missBufs[numMiss++] = bufs[i];
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        if(numMiss && bdisk_readv(cache->disk, missBlocks, missBufs, numMiss))
+            return -1;
+    }
+    return 0;
+}
+
+int cache_prefetch(bCache *cache, const size_t *blocks, size_t count)
+{
+    if(!cache->capacity)
+        return 0;
+    if(count > CACHE_PREFETCH_MAX)
+        count = CACHE_PREFETCH_MAX;
+
+    pthread_mutex_lock(&cache->prefetchLock);
+    size_t missBlocks[CACHE_PREFETCH_MAX];
+    void *missBufs[CACHE_PREFETCH_MAX];
+    size_t numMiss = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < count; ++i) {
+        if(cache->slotOf[blocks[i]] != NO_SLOT)
+            continue;
+        missBlocks[numMiss] = blocks[i];
+        missBufs[numMiss] = cache->prefetchBuf + numMiss * BLOCK_SIZE;
+        ++numMiss;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if(numMiss && bdisk_readv(cache->disk, missBlocks, missBufs, numMiss)){
+        pthread_mutex_unlock(&cache->prefetchLock);
+        return -1;
+    }
+
+    //same as a miss of cache_read, skip the blocks
+    //another thread brought in meanwhile
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < numMiss; ++i) {
+        if(cache->slotOf[missBlocks[i]] != NO_SLOT)
+            continue;
+        int slot = get_victim(cache);
+        if(slot == NO_SLOT)
+            break;
+        cache->entries[slot].block = missBlocks[i];
+        cache->entries[slot].dirty = false;
+        cache->slotOf[missBlocks[i]] = slot;
+        lru_push_front(cache, slot);
+        memcpy(slot_data(cache, slot), missBufs[i], BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_unlock(&cache->prefetchLock);
+    return 0;
+}
+
+size_t cache_capacity(bCache *cache)
+{
+    return cache->capacity;
+}
+
+int cache_peek(bCache *cache, size_t block, void *buf)
+{
+    if(!cache->capacity)
+        return -1;
+
+    pthread_mutex_lock(&cache->lock);
+    int slot = cache->slotOf[block];
+    if(slot != NO_SLOT)
+        memcpy(buf, slot_data(cache, slot), BLOCK_SIZE);
+    pthread_mutex_unlock(&cache->lock);
+    return slot == NO_SLOT ? -1 : 0;
+}
+
+/*
+ * copy the new content of @blocks into the slots that
+ * cache them, which become clean unless @dirty is set
+ */
+static void refresh_slots(bCache *cache, const size_t *blocks, void *const *bufs,
+                          size_t count, bool dirty)
+{
+    if(!cache->capacity)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < count; ++i) {
+        int slot = cache->slotOf[blocks[i]];
+        if(slot == NO_SLOT)
+            continue;
+        memcpy(slot_data(cache, slot), bufs[i], BLOCK_SIZE);
+        cache->entries[slot].dirty = dirty;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_refresh(bCache *cache, const size_t *blocks, void *const *bufs,
+                   size_t count)
+{
+    refresh_slots(cache, blocks, bufs, count, false);
+}
+
+int cache_writev(bCache *cache, const size_t *blocks, void *const *bufs,
+                 size_t count)
+{
+    //refresh first, so that a stale dirty copy can not be
+    //evicted over the new data once it is on the disk. The
+    //copies stay dirty until the write made it, a failed
+    //write is then retried by the writeback.
+    refresh_slots(cache, blocks, bufs, count, true);
+    if(bdisk_writev(cache->disk, blocks, bufs, count))
+        return -1;
+    refresh_slots(cache, blocks, bufs, count, false);
+    return 0;
+}
+
+int cache_writeback(bCache *cache, size_t block)
+{
+    if(!cache->capacity)
+        return 0;
+
+    int ret = 0;
+    pthread_mutex_lock(&cache->lock);
+    int slot = cache->slotOf[block];
+    if(slot != NO_SLOT && cache->entries[slot].dirty){
+        ret = bdisk_write(cache->disk, block, slot_data(cache, slot));
+        if(!ret)
+            cache->entries[slot].dirty = false;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+static int compare_block(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+int cache_flush(bCache *cache)
+{
+    if(!cache->capacity)
+        return 0;
+
+    pthread_mutex_lock(&cache->lock);
+    if(!cache->used){
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    size_t *blocks = cache->flushBlocks;
+    void **bufs = cache->flushBufs;
+
+    //write dirty blocks in disk order, so that
+    //neighbours go out in a single vectored write
+    size_t count = 0;
+    for (size_t i = 0; i < cache->used; ++i) {
+        if(cache->entries[i].dirty)
+            blocks[count++] = cache->entries[i].block;
+    }
+    qsort(blocks, count, sizeof(size_t), compare_block);
+    for (size_t j = 0; j < count; ++j)
+        bufs[j] = slot_data(cache, cache->slotOf[blocks[j]]);
+
+    int ret = bdisk_writev(cache->disk, blocks, bufs, count);
+    if(!ret) {
+        for (size_t k = 0; k < count; ++k)
+            cache->entries[cache->slotOf[blocks[k]]].dirty = false;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
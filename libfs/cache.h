@@ -0,0 +1,160 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+struct disk;
+
+/** Default number of blocks held by the buffer cache of a mounted disk */
+#define CACHE_DEFAULT_BLOCKS 64
+
+/** Most blocks read by one cache_prefetch() call */
+#define CACHE_PREFETCH_MAX 64
+
+/*
+ * Write-back LRU buffer cache sitting between fs.c and
+ * bdisk_read()/bdisk_write(). A cache of capacity 0 simply
+ * forwards every request to the disk. All functions
+ * may be called from several threads at once, concurrent
+ * writes of the same block must be ordered by the caller.
+ */
+typedef struct blockCache bCache;
+
+/**
+ * cache_create - Create a buffer cache
+ * @d: Disk the cached blocks belong to
+ * @capacity: Number of blocks the cache can hold, 0 to disable caching
+ * @numBlock: Number of blocks of the underlying disk
+ *
+ * Return: the new cache.
+ */
+bCache *cache_create(struct disk *d, size_t capacity, size_t numBlock);
+
+/**
+ * cache_destroy - Release a buffer cache
+ * @cache: Cache to release
+ *
+ * Dirty blocks are dropped, call cache_flush() first to keep them.
+ */
+void cache_destroy(bCache *cache);
+
+/**
+ * cache_read - Read a block through the cache
+ * @cache: Buffer cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block could not be read from the disk. 0 otherwise.
+ */
+int cache_read(bCache *cache, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @cache: Buffer cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty, it reaches the disk when it gets evicted
+ * or when cache_flush() is called.
+ *
+ * Return: -1 if a dirty block could not be evicted. 0 otherwise.
+ */
+int cache_write(bCache *cache, size_t block, const void *buf);
+
+/**
+ * cache_readv - Read a list of whole blocks through the cache
+ * @cache: Buffer cache
+ * @blocks: Indexes of the blocks to read from
+ * @bufs: Data buffers to be filled, one per block
+ * @count: Number of blocks
+ *
+ * Cached blocks are copied from memory, the others are read from the disk with
+ * bdisk_readv() without being added to the cache, so that large transfers do
+ * not evict hot blocks.
+ *
+ * Return: -1 if a block could not be read from the disk. 0 otherwise.
+ */
+int cache_readv(bCache *cache, const size_t *blocks, void *const *bufs,
+                size_t count);
+
+/**
+ * cache_writev - Write a list of whole blocks through the cache
+ * @cache: Buffer cache
+ * @blocks: Indexes of the blocks to write to
+ * @bufs: Data buffers to write in the blocks, one per block
+ * @count: Number of blocks
+ *
+ * The blocks are written to the disk with bdisk_writev(), copies held by the
+ * cache are updated and become clean once the write succeeded. If it failed,
+ * they keep the new content as dirty blocks.
+ *
+ * Return: -1 if a block could not be written. 0 otherwise.
+ */
+int cache_writev(bCache *cache, const size_t *blocks, void *const *bufs,
+                 size_t count);
+
+/**
+ * cache_prefetch - Bring blocks into the cache ahead of their use
+ * @cache: Buffer cache
+ * @blocks: Indexes of the blocks to read
+ * @count: Number of blocks, only the first CACHE_PREFETCH_MAX are read
+ *
+ * The blocks that are not cached are read from the disk with one
+ * bdisk_readv() call and added to the cache as clean blocks. Nothing
+ * happens if the cache is disabled.
+ *
+ * Return: -1 if the blocks could not be read from the disk. 0 otherwise.
+ */
+int cache_prefetch(bCache *cache, const size_t *blocks, size_t count);
+
+/**
+ * cache_capacity - Get the number of blocks a cache can hold
+ * @cache: Buffer cache
+ *
+ * Return: the capacity given to cache_create().
+ */
+size_t cache_capacity(bCache *cache);
+
+/**
+ * cache_peek - Copy a block out of the cache if it is there
+ * @cache: Buffer cache
+ * @block: Index of the block
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block is not cached (@buf is left untouched). 0 otherwise.
+ */
+int cache_peek(bCache *cache, size_t block, void *buf);
+
+/**
+ * cache_refresh - Update cached copies of blocks written behind the cache
+ * @cache: Buffer cache
+ * @blocks: Indexes of the blocks that were written
+ * @bufs: New content of the blocks, one per block
+ * @count: Number of blocks
+ *
+ * Copies held by the cache take the new content and become clean, blocks that
+ * are not cached are ignored.
+ */
+void cache_refresh(bCache *cache, const size_t *blocks, void *const *bufs,
+                   size_t count);
+
+/**
+ * cache_writeback - Write one block back to the disk if it is dirty
+ * @cache: Buffer cache
+ * @block: Index of the block
+ *
+ * The block stays in the cache, clean.
+ *
+ * Return: -1 if the block could not be written. 0 otherwise.
+ */
+int cache_writeback(bCache *cache, size_t block);
+
+/**
+ * cache_flush - Write every dirty block back to the disk
+ * @cache: Buffer cache
+ *
+ * Return: -1 if one of the blocks could not be written. 0 otherwise.
+ */
+int cache_flush(bCache *cache);
+
+#endif /* _CACHE_H */
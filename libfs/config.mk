@@ -0,0 +1,6 @@
+# Sizes fixed at build time, see fs.h. For instance
+#	make FS_BLOCK_SIZE=65536 FS_FILENAME_LEN=48
+# Run make clean when changing them, the library and the
+# programs using it must be built with the same values.
+CONFIG_VARS := FS_BLOCK_SIZE FS_FILENAME_LEN FS_OPEN_MAX_COUNT
+CONFIG_FLAGS := $(foreach v,$(CONFIG_VARS),$(if $($(v)),-D$(v)=$($(v))))
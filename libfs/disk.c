@@ -1,17 +1,84 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <linux/io_uring.h>
+/* Pulled in by <linux/fs.h>, ours is the one defined in disk.h */
+#undef BLOCK_SIZE
+
 #include "disk.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+_Static_assert(BLOCK_SIZE >= 512 && (BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0,
+	       "FS_BLOCK_SIZE must be a power of two of at least 512");
+
+/* Maximum number of blocks gathered in a single preadv()/pwritev() */
+#define IOV_BATCH 256
+
+/* Number of submission queue entries, and of requests in flight */
+#define URING_ENTRIES 64
+
+/* Requests issued by one uring_iov() call */
+struct batch {
+	/* Requests not completed yet */
+	unsigned left;
+	/* Whether one of them failed */
+	int err;
+};
+
+/* Asynchronous request (see block_queue_read()) */
+struct request {
+	/* Caller's tag, reported on completion */
+	void *tag;
+	/* Remaining part of the transfer */
+	struct iovec *iov;
+	int iovcnt;
+	off_t off;
+	/* Storage for single buffer requests */
+	struct iovec one;
+	int write;
+	/* Batch of the block layer itself, not reported to the caller */
+	struct batch *batch;
+	/* Next free request */
+	int next_free;
+};
+
+/* io_uring instance of %BLOCK_BACKEND_URING */
+struct uring {
+	int fd;
+	/* Submission ring */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion ring */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings of the rings */
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	/* Entries queued but not submitted yet */
+	unsigned pending;
+	/* Requests, indexed by the user_data of their entries */
+	struct request reqs[URING_ENTRIES];
+	int free_req;
+	/* Requests issued to the kernel and not completed yet */
+	unsigned inflight;
+	/* A thread waits for completions in the kernel (see uring_wait()) */
+	int reaping;
+	pthread_cond_t reaped;
+	/* Disk the ring belongs to */
+	struct disk *disk;
+};
 
 /* Disk instance description */
 struct disk {
@@ -19,126 +86,999 @@ struct disk {
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Mapping of the whole image with %BLOCK_BACKEND_MMAP, NULL otherwise */
+	char *map;
+	/* Ring of %BLOCK_BACKEND_URING, NULL otherwise */
+	struct uring *ring;
+	/* Asynchronous requests queued and not reported yet */
+	size_t outstanding;
+	/* Completions not reported yet by block_complete() */
+	struct block_completion *done;
+	size_t ndone, done_cap;
+	/*
+	 * Protects the ring and the completions above. Positional I/O and the
+	 * mapping need no lock.
+	 */
+	pthread_mutex_t lock;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Virtual disk used by the block_*() functions (none by default) */
+static struct disk *default_disk;
 
-int block_disk_open(const char *diskname)
+static int uring_open(struct disk *d);
+static int uring_close(struct disk *d);
+
+/* Backend used by the next bdisk_open() */
+static int backend = BLOCK_BACKEND_PIO;
+
+int block_disk_set_backend(int new_backend)
 {
+	if (new_backend != BLOCK_BACKEND_PIO &&
+	    new_backend != BLOCK_BACKEND_MMAP &&
+	    new_backend != BLOCK_BACKEND_URING) {
+		block_error("invalid backend '%d'", new_backend);
+		return -1;
+	}
+
+	backend = new_backend;
+
+	return 0;
+}
+
+/* Check that @d is an open disk */
+static int check_disk(struct disk *d)
+{
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct disk *bdisk_open(const char *diskname)
+{
+	struct disk *d;
 	int fd;
 	struct stat st;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
-		return -1;
-	}
-
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+		return NULL;
 	}
 
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return NULL;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
+
+	if (backend == BLOCK_BACKEND_MMAP) {
+		void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			free(d);
+			return NULL;
+		}
+		d->map = map;
+	}
+
+	d->fd = fd;
+	d->bcount = st.st_size / BLOCK_SIZE;
+	pthread_mutex_init(&d->lock, NULL);
+
+	/* Fall back to positional I/O if io_uring is not available */
+	if (backend == BLOCK_BACKEND_URING && uring_open(d))
+		block_error("io_uring unavailable, using positional I/O");
+
+	return d;
+}
+
+int bdisk_sync(struct disk *d)
+{
+	if (check_disk(d))
 		return -1;
+
+	if (d->map) {
+		if (msync(d->map, d->bcount * BLOCK_SIZE, MS_SYNC)) {
+			perror("msync");
+			return -1;
+		}
+		return 0;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	if (fsync(d->fd)) {
+		perror("fsync");
+		return -1;
+	}
 
 	return 0;
 }
 
-int block_disk_close(void)
+int bdisk_close(struct disk *d)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	int ret = 0;
+
+	if (check_disk(d))
 		return -1;
+
+	pthread_mutex_lock(&d->lock);
+	if (uring_close(d))
+		ret = -1;
+	pthread_mutex_unlock(&d->lock);
+
+	/* The disk goes away even if its last flush fails */
+	if (d->map) {
+		if (msync(d->map, d->bcount * BLOCK_SIZE, MS_SYNC)) {
+			perror("msync");
+			ret = -1;
+		}
+		munmap(d->map, d->bcount * BLOCK_SIZE);
 	}
 
-	close(disk.fd);
+	close(d->fd);
+	pthread_mutex_destroy(&d->lock);
+	free(d->done);
+	free(d);
 
-	disk.fd = INVALID_FD;
+	return ret;
+}
 
-	return 0;
+int bdisk_count(struct disk *d)
+{
+	if (check_disk(d))
+		return -1;
+
+	return d->bcount;
 }
 
-int block_disk_count(void)
+int block_disk_open(const char *diskname)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	if (default_disk) {
+		block_error("disk already open");
 		return -1;
 	}
 
-	return disk.bcount;
+	default_disk = bdisk_open(diskname);
+	return default_disk ? 0 : -1;
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	int ret = bdisk_close(default_disk);
+
+	default_disk = NULL;
+	return ret;
+}
+
+int block_disk_sync(void)
+{
+	return bdisk_sync(default_disk);
+}
+
+int block_disk_count(void)
+{
+	return bdisk_count(default_disk);
+}
+
+/*
+ * Transfer exactly @len bytes at offset @off of the disk image with positional
+ * I/O, so that the file offset of @d->fd is never used. Short transfers are
+ * resumed where they stopped, interrupted calls are restarted.
+ */
+static int disk_pread(struct disk *d, void *buf, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t ret = pread(d->fd, buf, len, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk image");
+			return -1;
+		}
+		buf = (char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+
+	return 0;
+}
+
+static int disk_pwrite(struct disk *d, const void *buf, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t ret = pwrite(d->fd, buf, len, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("pwrite");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("disk image write made no progress");
+			return -1;
+		}
+		buf = (const char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Vectored versions of disk_pread() and disk_pwrite(). @iov is consumed while
+ * short transfers are resumed.
+ */
+static int disk_preadv(struct disk *d, struct iovec *iov, int iovcnt, off_t off)
+{
+	while (iovcnt) {
+		ssize_t ret = preadv(d->fd, iov, iovcnt, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk image");
+			return -1;
+		}
+		off += ret;
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int disk_pwritev(struct disk *d, struct iovec *iov, int iovcnt, off_t off)
+{
+	while (iovcnt) {
+		ssize_t ret = pwritev(d->fd, iov, iovcnt, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("pwritev");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("disk image write made no progress");
+			return -1;
+		}
+		off += ret;
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Check that blocks @block to @block + @count - 1 can be accessed */
+static int check_range(struct disk *d, size_t block, size_t count)
+{
+	if (check_disk(d))
+		return -1;
+
+	if (block >= d->bcount || count > d->bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, d->bcount);
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	return 0;
+}
+
+/*
+ * io_uring backend. The rings are set up with raw system calls, entries
+ * always use vectored reads/writes so that both single buffer requests and
+ * block lists go through the same path.
+ */
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(struct uring *ring, unsigned to_submit,
+		       unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+			      min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		perror("io_uring_enter");
+	return ret;
+}
+
+static int uring_open(struct disk *d)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+	char *sq, *cq;
+	int i;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		free(ring);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		if (ring->sq_ptr != MAP_FAILED)
+			munmap(ring->sq_ptr, ring->sq_len);
+		if (ring->cq_ptr != MAP_FAILED)
+			munmap(ring->cq_ptr, ring->cq_len);
+		if (ring->sqes != MAP_FAILED)
+			munmap(ring->sqes, ring->sqes_len);
+		close(ring->fd);
+		free(ring);
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	sq = ring->sq_ptr;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq = ring->cq_ptr;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	for (i = 0; i < URING_ENTRIES; i++)
+		ring->reqs[i].next_free = i + 1;
+	ring->reqs[URING_ENTRIES - 1].next_free = -1;
+	ring->free_req = 0;
+	pthread_cond_init(&ring->reaped, NULL);
+
+	ring->disk = d;
+	d->ring = ring;
+	return 0;
+}
+
+/* Hand @req (or what is left of it) to the submission ring */
+static void uring_push(struct uring *ring, int id)
+{
+	struct request *req = &ring->reqs[id];
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = ring->disk->fd;
+	sqe->off = req->off;
+	sqe->addr = (unsigned long)req->iov;
+	sqe->len = req->iovcnt;
+	sqe->user_data = id;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+}
+
+static int uring_submit(struct uring *ring)
+{
+	while (ring->pending) {
+		int ret = uring_enter(ring, ring->pending, 0);
+
+		if (ret < 0)
+			return -1;
+		ring->pending -= ret;
+		ring->inflight += ret;
+	}
+
+	return 0;
+}
+
+/* Record a completion for block_complete() */
+static void push_completion(struct disk *d, void *tag, int result)
+{
+	if (d->ndone == d->done_cap) {
+		size_t cap = d->done_cap ? 2 * d->done_cap : URING_ENTRIES;
+		struct block_completion *done;
+
+		done = realloc(d->done, cap * sizeof(*done));
+		if (!done) {
+			perror("realloc");
+			exit(1);
+		}
+		d->done = done;
+		d->done_cap = cap;
+	}
+
+	d->done[d->ndone].tag = tag;
+	d->done[d->ndone].result = result;
+	d->ndone++;
+}
+
+static void release_request(struct uring *ring, int id, int result)
+{
+	struct request *req = &ring->reqs[id];
+
+	if (req->batch) {
+		req->batch->left--;
+		if (result)
+			req->batch->err = 1;
+	} else {
+		push_completion(ring->disk, req->tag, result);
+	}
+
+	req->next_free = ring->free_req;
+	ring->free_req = id;
+}
+
+/*
+ * Process the completion entries that are already there. Short transfers are
+ * resubmitted for the part that is left. Entries are left alone while a thread
+ * waits for them in uring_wait(), it processes them when it is back.
+ */
+static int uring_reap(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (ring->reaping)
+		return 0;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		int id = cqe->user_data;
+		struct request *req = &ring->reqs[id];
+		int res = cqe->res;
+
+		head++;
+		ring->inflight--;
+
+		if (res <= 0) {
+			if (res < 0)
+				block_error("%s: %s", req->write ?
+					    "write" : "read", strerror(-res));
+			else if (req->write)
+				block_error("disk image write made no progress");
+			else
+				block_error("unexpected end of disk image");
+			release_request(ring, id, -1);
+			continue;
+		}
+
+		/* Skip what was transferred, resubmit the rest */
+		req->off += res;
+		while (req->iovcnt && (size_t)res >= req->iov->iov_len) {
+			res -= req->iov->iov_len;
+			req->iov++;
+			req->iovcnt--;
+		}
+		if (!req->iovcnt) {
+			release_request(ring, id, 0);
+			continue;
+		}
+		req->iov->iov_base = (char *)req->iov->iov_base + res;
+		req->iov->iov_len -= res;
+		uring_push(ring, id);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return uring_submit(ring);
+}
+
+/*
+ * Wait until more requests completed, with the lock of the disk held. A single thread
+ * waits in the kernel, without the lock so that others can queue requests
+ * meanwhile, and processes what completed. The other threads sleep until it
+ * is back, then check again whether their own requests completed. The caller
+ * must have requests in flight.
+ */
+static int uring_wait(struct uring *ring)
+{
+	pthread_mutex_t *lock = &ring->disk->lock;
+	int ret;
+
+	if (ring->reaping) {
+		pthread_cond_wait(&ring->reaped, lock);
+		return 0;
+	}
+
+	ring->reaping = 1;
+	pthread_mutex_unlock(lock);
+	ret = uring_enter(ring, 0, 1);
+	pthread_mutex_lock(lock);
+	ring->reaping = 0;
+
+	if (ret >= 0)
+		ret = uring_reap(ring);
+	pthread_cond_broadcast(&ring->reaped);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Queue a request on the ring, making room first if all requests are in
+ * flight. Completions reaped meanwhile are kept for block_complete(). The
+ * request transfers either the list @iov, or @buf if @iov is NULL.
+ */
+static int uring_queue(struct uring *ring, struct iovec *iov, int iovcnt,
+		       void *buf, size_t len, off_t off, int write, void *tag,
+		       struct batch *batch)
+{
+	struct request *req;
+	int id;
+
+	while (ring->free_req < 0) {
+		if (uring_submit(ring) || uring_reap(ring))
+			return -1;
+		if (ring->free_req < 0 && uring_wait(ring))
+			return -1;
+	}
+
+	id = ring->free_req;
+	req = &ring->reqs[id];
+	ring->free_req = req->next_free;
+
+	req->tag = tag;
+	if (iov) {
+		req->iov = iov;
+		req->iovcnt = iovcnt;
+	} else {
+		req->one.iov_base = buf;
+		req->one.iov_len = len;
+		req->iov = &req->one;
+		req->iovcnt = 1;
+	}
+	req->off = off;
+	req->write = write;
+	req->batch = batch;
+	if (batch)
+		batch->left++;
+
+	uring_push(ring, id);
+	return 0;
+}
+
+/*
+ * Wait for every request of the ring of @d, then tear it down. Called with
+ * @d->lock held. If the kernel cannot be waited for, the ring is left mapped
+ * since completions may still arrive, and -1 is returned.
+ */
+static int uring_close(struct disk *d)
+{
+	struct uring *ring = d->ring;
+
+	if (!ring)
+		return 0;
+
+	while (ring->inflight || ring->pending) {
+		if (uring_submit(ring) || uring_wait(ring)) {
+			block_error("%u requests still in flight",
+				    ring->inflight + ring->pending);
+			d->ring = NULL;
+			return -1;
+		}
+	}
+
+	pthread_cond_destroy(&ring->reaped);
+	munmap(ring->sqes, ring->sqes_len);
+	munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+	free(ring);
+	d->ring = NULL;
+	return 0;
+}
+
+/*
+ * Transfer a list of block runs through the ring: every run is queued, all
+ * of them are submitted together, then we wait for all completions. Called
+ * with @d->lock held.
+ */
+static int uring_iov(struct disk *d, const size_t *blocks, void *const *bufs,
+		     size_t count, int write)
+{
+	struct uring *ring = d->ring;
+	struct iovec iov[IOV_BATCH];
+	struct batch batch;
+	size_t i, n, base;
+
+	for (base = 0; base < count; base += IOV_BATCH) {
+		size_t end = count - base < IOV_BATCH ? count : base + IOV_BATCH;
+
+		batch.left = 0;
+		batch.err = 0;
+		for (i = base; i < end; i += n) {
+			for (n = 0; i + n < end; n++) {
+				if (n && blocks[i + n] != blocks[i] + n)
+					break;
+				iov[i - base + n].iov_base = bufs[i + n];
+				iov[i - base + n].iov_len = BLOCK_SIZE;
+			}
+			if (check_range(d, blocks[i], n))
+				goto drain;
+			if (uring_queue(ring, &iov[i - base], n, NULL, 0,
+					(off_t)blocks[i] * BLOCK_SIZE, write,
+					NULL, &batch))
+				goto drain;
+		}
+
+		if (uring_submit(ring) || uring_reap(ring))
+			goto drain;
+		while (batch.left) {
+			if (uring_wait(ring))
+				return -1;
+		}
+		if (batch.err)
+			return -1;
+	}
+
+	return 0;
+
+drain:
+	/* @batch and @iov live on our stack, let queued requests finish */
+	while (batch.left && !uring_submit(ring) && !uring_wait(ring))
+		;
+	return -1;
+}
+
+/*
+ * Split @blocks into runs of consecutive indexes and transfer each run with a
+ * single vectored I/O
+ */
+static int block_iov(struct disk *d, const size_t *blocks, void *const *bufs,
+		     size_t count, int write)
+{
+	struct iovec iov[IOV_BATCH];
+	size_t i, n;
+
+	if (check_disk(d))
 		return -1;
+
+	if (d->map) {
+		for (i = 0; i < count; i++) {
+			if (check_range(d, blocks[i], 1))
+				return -1;
+			if (write)
+				memcpy(d->map + blocks[i] * BLOCK_SIZE,
+				       bufs[i], BLOCK_SIZE);
+			else
+				memcpy(bufs[i], d->map + blocks[i] * BLOCK_SIZE,
+				       BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	if (d->ring) {
+		int ret;
+
+		pthread_mutex_lock(&d->lock);
+		ret = uring_iov(d, blocks, bufs, count, write);
+		pthread_mutex_unlock(&d->lock);
+		return ret;
+	}
+
+	for (i = 0; i < count; i += n) {
+		for (n = 0; i + n < count && n < IOV_BATCH; n++) {
+			if (n && blocks[i + n] != blocks[i] + n)
+				break;
+			iov[n].iov_base = bufs[i + n];
+			iov[n].iov_len = BLOCK_SIZE;
+		}
+		if (check_range(d, blocks[i], n))
+			return -1;
+
+		if (write && disk_pwritev(d, iov, n, (off_t)blocks[i] * BLOCK_SIZE))
+			return -1;
+		if (!write && disk_preadv(d, iov, n, (off_t)blocks[i] * BLOCK_SIZE))
+			return -1;
 	}
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+int bdisk_write_range(struct disk *d, size_t block, size_t count,
+		      const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	if (check_range(d, block, count))
 		return -1;
+
+	if (d->map) {
+		memcpy(d->map + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+		return 0;
 	}
 
-	if (block >= disk.bcount) {
+	return disk_pwrite(d, buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
+
+int bdisk_read_range(struct disk *d, size_t block, size_t count, void *buf)
+{
+	if (check_range(d, block, count))
+		return -1;
+
+	if (d->map) {
+		memcpy(buf, d->map + block * BLOCK_SIZE, count * BLOCK_SIZE);
+		return 0;
+	}
+
+	return disk_pread(d, buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
+
+int bdisk_writev(struct disk *d, const size_t *blocks, void *const *bufs,
+		 size_t count)
+{
+	return block_iov(d, blocks, bufs, count, 1);
+}
+
+int bdisk_readv(struct disk *d, const size_t *blocks, void *const *bufs,
+		size_t count)
+{
+	return block_iov(d, blocks, bufs, count, 0);
+}
+
+int bdisk_write(struct disk *d, size_t block, const void *buf)
+{
+	if (check_disk(d))
+		return -1;
+
+	if (block >= d->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, d->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (d->map) {
+		memcpy(d->map + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+		return 0;
+	}
+
+	/* Perform the actual write into the disk image */
+	return disk_pwrite(d, buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
+
+int bdisk_read(struct disk *d, size_t block, void *buf)
+{
+	if (check_disk(d))
+		return -1;
+
+	if (block >= d->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, d->bcount);
 		return -1;
 	}
 
+	if (d->map) {
+		memcpy(buf, d->map + block * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
+	}
+
 	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return disk_pread(d, buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
+
+void *bdisk_map(struct disk *d, size_t block)
+{
+	if (!d || !d->map || block >= d->bcount)
+		return NULL;
+
+	return d->map + block * BLOCK_SIZE;
+}
+
+/*
+ * Asynchronous requests. Without io_uring the transfer is performed right
+ * away and only its completion is deferred, so callers see the same behavior
+ * with every backend.
+ */
+static int block_queue(struct disk *d, size_t block, size_t count, void *buf,
+		       int write, void *tag)
+{
+	int result;
+
+	if (check_range(d, block, count))
 		return -1;
+
+	if (d->ring) {
+		pthread_mutex_lock(&d->lock);
+		result = uring_queue(d->ring, NULL, 0, buf, count * BLOCK_SIZE,
+				     (off_t)block * BLOCK_SIZE, write, tag, NULL);
+		if (!result)
+			d->outstanding++;
+		pthread_mutex_unlock(&d->lock);
+		return result;
 	}
 
+	if (write)
+		result = bdisk_write_range(d, block, count, buf);
+	else
+		result = bdisk_read_range(d, block, count, buf);
+
+	pthread_mutex_lock(&d->lock);
+	push_completion(d, tag, result);
+	d->outstanding++;
+	pthread_mutex_unlock(&d->lock);
 	return 0;
 }
 
+int bdisk_queue_write(struct disk *d, size_t block, size_t count,
+		      const void *buf, void *tag)
+{
+	return block_queue(d, block, count, (void *)buf, 1, tag);
+}
+
+int bdisk_queue_read(struct disk *d, size_t block, size_t count, void *buf,
+		     void *tag)
+{
+	return block_queue(d, block, count, buf, 0, tag);
+}
+
+int bdisk_submit(struct disk *d)
+{
+	int ret = 0;
+
+	if (check_disk(d))
+		return -1;
+
+	if (d->ring) {
+		pthread_mutex_lock(&d->lock);
+		ret = uring_submit(d->ring);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	return ret;
+}
+
+int bdisk_complete(struct disk *d, struct block_completion *done, size_t max,
+		   size_t min)
+{
+	size_t n;
+	int ret = 0;
+
+	if (check_disk(d))
+		return -1;
+
+	if (min > max)
+		min = max;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->ring) {
+		/* Collect what is already there without waiting */
+		ret = uring_submit(d->ring) || uring_reap(d->ring);
+		/*
+		 * Other threads may take completions meanwhile, never wait
+		 * for more than what is still outstanding
+		 */
+		while (!ret && d->ndone < min && d->ndone < d->outstanding)
+			ret = uring_submit(d->ring) || uring_wait(d->ring);
+	}
+
+	n = d->ndone < max ? d->ndone : max;
+	memcpy(done, d->done, n * sizeof(*done));
+	memmove(d->done, d->done + n, (d->ndone - n) * sizeof(*done));
+	d->ndone -= n;
+	d->outstanding -= n;
+	pthread_mutex_unlock(&d->lock);
+
+	return ret ? -1 : n;
+}
+
+/*
+ * Block functions working on the default disk
+ */
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	return bdisk_write_range(default_disk, block, count, buf);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	return bdisk_read_range(default_disk, block, count, buf);
+}
+
+int block_writev(const size_t *blocks, void *const *bufs, size_t count)
+{
+	return bdisk_writev(default_disk, blocks, bufs, count);
+}
+
+int block_readv(const size_t *blocks, void *const *bufs, size_t count)
+{
+	return bdisk_readv(default_disk, blocks, bufs, count);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return bdisk_write(default_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return bdisk_read(default_disk, block, buf);
+}
+
+void *block_map(size_t block)
+{
+	return bdisk_map(default_disk, block);
+}
+
+int block_queue_write(size_t block, size_t count, const void *buf, void *tag)
+{
+	return bdisk_queue_write(default_disk, block, count, buf, tag);
+}
+
+int block_queue_read(size_t block, size_t count, void *buf, void *tag)
+{
+	return bdisk_queue_read(default_disk, block, count, buf, tag);
+}
+
+int block_submit(void)
+{
+	return bdisk_submit(default_disk);
+}
+
+int block_complete(struct block_completion *done, size_t max, size_t min)
+{
+	return bdisk_complete(default_disk, done, max, min);
+}
@@ -3,8 +3,33 @@
 
 #include <stddef.h> /* for size_t definition */
 
-/** Size of a disk block in bytes */
-#define BLOCK_SIZE 4096
+/** Size of a disk block in bytes, see %FS_BLOCK_SIZE in fs.h */
+#ifndef FS_BLOCK_SIZE
+#define FS_BLOCK_SIZE 4096
+#endif
+#define BLOCK_SIZE FS_BLOCK_SIZE
+
+/** Backends for block_disk_set_backend() */
+#define BLOCK_BACKEND_PIO 0
+#define BLOCK_BACKEND_MMAP 1
+#define BLOCK_BACKEND_URING 2
+
+/**
+ * block_disk_set_backend - Choose how the next virtual disk is accessed
+ * @backend: %BLOCK_BACKEND_PIO, %BLOCK_BACKEND_MMAP or %BLOCK_BACKEND_URING
+ *
+ * With %BLOCK_BACKEND_PIO (default), every block is transferred with a
+ * positional read or write system call. With %BLOCK_BACKEND_MMAP, the whole
+ * virtual disk file is mapped in memory by block_disk_open() and blocks are
+ * copied to or from the mapping. With %BLOCK_BACKEND_URING, block lists and
+ * asynchronous requests (see block_queue_read()) are submitted together
+ * through an io_uring instance, falling back to %BLOCK_BACKEND_PIO if io_uring
+ * is not available. The backend of a disk that is already open does not
+ * change.
+ *
+ * Return: -1 if @backend is invalid. 0 otherwise.
+ */
+int block_disk_set_backend(int backend);
 
 /**
  * block_disk_open - Open virtual disk file
@@ -22,10 +47,25 @@ int block_disk_open(const char *diskname);
 /**
  * block_disk_close - Close virtual disk file
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * With %BLOCK_BACKEND_MMAP, the mapping is flushed to the file first. The
+ * virtual disk file is closed even if that fails.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if flushing the
+ * mapping or waiting for queued requests failed. 0 otherwise.
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Make virtual disk file durable
+ *
+ * Flush the blocks written so far to stable storage (msync() of the mapping
+ * with %BLOCK_BACKEND_MMAP, fsync() of the file otherwise).
+ *
+ * Return: -1 if there was no virtual disk file opened, or if flushing failed.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -60,5 +100,196 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the
+ * virtual disk's blocks @block to @block + @count - 1 with a single I/O.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf with a single I/O.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_writev - Write a list of blocks to disk
+ * @blocks: Indexes of the blocks to write to
+ * @bufs: Data buffers to write in the blocks, one per block
+ * @count: Number of blocks
+ *
+ * Write the content of each buffer @bufs[i] (%BLOCK_SIZE bytes) in the virtual
+ * disk's block @blocks[i]. Blocks whose indexes follow each other in @blocks
+ * are written with a single vectored I/O. Buffers are not modified.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible or if one
+ * of the writing operations fails. 0 otherwise.
+ */
+int block_writev(const size_t *blocks, void *const *bufs, size_t count);
+
+/**
+ * block_readv - Read a list of blocks from disk
+ * @blocks: Indexes of the blocks to read from
+ * @bufs: Data buffers to be filled, one per block
+ * @count: Number of blocks
+ *
+ * Read the content of virtual disk's block @blocks[i] (%BLOCK_SIZE bytes) into
+ * buffer @bufs[i]. Blocks whose indexes follow each other in @blocks are read
+ * with a single vectored I/O.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible, or if one
+ * of the reading operations fails. 0 otherwise.
+ */
+int block_readv(const size_t *blocks, void *const *bufs, size_t count);
+
+/**
+ * block_map - Get the address of a block in memory
+ * @block: Index of the block
+ *
+ * Only available with %BLOCK_BACKEND_MMAP. The address stays valid until the
+ * virtual disk is closed, and the content it points to changes whenever the
+ * block is written.
+ *
+ * Return: NULL if the virtual disk is not mapped in memory or if @block is out
+ * of bounds. Otherwise the address of the block in the mapping.
+ */
+void *block_map(size_t block);
+
+/** Completion of an asynchronous request, see block_complete() */
+struct block_completion {
+	/* Tag given when the request was queued */
+	void *tag;
+	/* 0 if the transfer succeeded, -1 otherwise */
+	int result;
+};
+
+/**
+ * block_queue_write - Queue an asynchronous write of consecutive blocks
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ * @tag: Value reported by block_complete() for this request
+ *
+ * Queue the write of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1. Queued requests are sent to the
+ * disk together by block_submit() or block_complete(). @buf must stay valid
+ * until the request is reported by block_complete(). Without the io_uring
+ * backend, the write is performed right away and only its completion is
+ * deferred.
+ *
+ * Return: -1 if one of the blocks is out of bounds or if the request could not
+ * be queued. 0 otherwise.
+ */
+int block_queue_write(size_t block, size_t count, const void *buf, void *tag);
+
+/**
+ * block_queue_read - Queue an asynchronous read of consecutive blocks
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ * @tag: Value reported by block_complete() for this request
+ *
+ * Same as block_queue_write(), for reading.
+ *
+ * Return: -1 if one of the blocks is out of bounds or if the request could not
+ * be queued. 0 otherwise.
+ */
+int block_queue_read(size_t block, size_t count, void *buf, void *tag);
+
+/**
+ * block_submit - Send queued requests to the disk
+ *
+ * Return: -1 if there was no virtual disk file opened, or if submission
+ * failed. 0 otherwise.
+ */
+int block_submit(void);
+
+/**
+ * block_complete - Collect completed asynchronous requests
+ * @done: Array to be filled with completions
+ * @max: Number of entries of @done
+ * @min: Number of completions to wait for
+ *
+ * Submit the queued requests, then wait until at least @min of them completed
+ * (fewer if fewer are outstanding), and report up to @max completions in
+ * @done.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if waiting failed.
+ * Otherwise the number of completions reported.
+ */
+int block_complete(struct block_completion *done, size_t max, size_t min);
+
+/*
+ * Handle based interface. The block_*() functions above work on a single
+ * default disk; several virtual disks can be open at once through handles,
+ * each with its own backend, ring and completions.
+ */
+
+/** Open virtual disk, see bdisk_open() */
+struct disk;
+
+/**
+ * bdisk_open - Open a virtual disk file and get a handle on it
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as block_disk_open(), except that any number of virtual disk files can
+ * be open at the same time. The backend set by block_disk_set_backend() is
+ * used.
+ *
+ * Return: NULL if @diskname is invalid or if the virtual disk file cannot be
+ * opened. Otherwise a handle to pass to the other bdisk_*() functions.
+ */
+struct disk *bdisk_open(const char *diskname);
+
+/**
+ * bdisk_close - Close a virtual disk file opened by bdisk_open()
+ * @d: Disk handle, invalid afterwards
+ *
+ * Return: -1 if @d is NULL, if flushing the mapping of %BLOCK_BACKEND_MMAP
+ * failed, or if requests queued with %BLOCK_BACKEND_URING could not be waited
+ * for (@d is closed anyway). 0 otherwise.
+ */
+int bdisk_close(struct disk *d);
+
+/*
+ * Each of the following does what the block_*() function of the same name does,
+ * on disk @d instead of the default one.
+ */
+int bdisk_sync(struct disk *d);
+int bdisk_count(struct disk *d);
+int bdisk_write(struct disk *d, size_t block, const void *buf);
+int bdisk_read(struct disk *d, size_t block, void *buf);
+int bdisk_write_range(struct disk *d, size_t block, size_t count,
+		      const void *buf);
+int bdisk_read_range(struct disk *d, size_t block, size_t count, void *buf);
+int bdisk_writev(struct disk *d, const size_t *blocks, void *const *bufs,
+		 size_t count);
+int bdisk_readv(struct disk *d, const size_t *blocks, void *const *bufs,
+		size_t count);
+void *bdisk_map(struct disk *d, size_t block);
+int bdisk_queue_write(struct disk *d, size_t block, size_t count,
+		      const void *buf, void *tag);
+int bdisk_queue_read(struct disk *d, size_t block, size_t count, void *buf,
+		     void *tag);
+int bdisk_submit(struct disk *d);
+int bdisk_complete(struct disk *d, struct block_completion *done, size_t max,
+		   size_t min);
+
 #endif /* _DISK_H */
 
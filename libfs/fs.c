@@ -1,17 +1,53 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
 
-#define FAT_EOC 0xFFFF
+//end of a FAT chain in memory, 16-bit formats use NARROW_EOC on the disk
+#define FAT_EOC 0xFFFFFFFF
+#define NARROW_EOC 0xFFFF
+//tail of a file that has not been looked up yet,
+//FAT entry 0 is reserved so no file can end there
+#define TAIL_UNKNOWN 0
 #define SIGNATURE "ECS150FS"
+//superblock versions, the legacy layout leaves the
+//version byte zero and has a one-block root directory
+#define FS_VERSION_LEGACY 0
+#define FS_VERSION_DIR 1
+//32-bit block indices and 64-bit file sizes
+#define FS_VERSION_WIDE 2
+//block size and filename length of the legacy layout, the
+//superblock of the other formats records the ones in use
+#define LEGACY_BLOCK_SHIFT 12
+#define NARROW_NAME_LEN 16
+#define BLOCK_SHIFT __builtin_ctz(BLOCK_SIZE)
+#define ENTRY_PER_BLOCK (BLOCK_SIZE / sizeof(fileInfo))
 
 #define BLOCK_NUM(a) ((a + BLOCK_SIZE - 1)/BLOCK_SIZE)
+#define MAP_WORD_BITS 64
+//most blocks handed to the block layer in one vectored call
+#define FS_IO_BATCH 256
+//read-ahead window of a descriptor, in blocks. It never
+//exceeds a quarter of the buffer cache.
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS CACHE_PREFETCH_MAX
+//alignment of scratch buffers
+#define CACHE_LINE 64
+//most bytes one read or write transfers, so that the count fits the result
+#define MAX_TRANSFER INT_MAX
+#define FAT_ENTRY_SIZE(narrow) ((narrow) ? sizeof(uint16_t) : sizeof(uint32_t))
+#define MAP_WORDS(a) ((a + MAP_WORD_BITS - 1)/MAP_WORD_BITS)
+//empty bucket of the filename index
+#define NO_ENTRY (-1)
 #define die_perror(msg)			\
 do {							\
 	perror(msg);				\
@@ -20,192 +56,646 @@ do {							\
 
 typedef struct __attribute__((__packed__)) superBlock{
     char signature[8];
+    //layout of the 16-bit formats, zero since FS_VERSION_WIDE
     uint16_t totalBlock;
     uint16_t rootIndex;
     uint16_t dataStartIndex;
     uint16_t numDataBlock;
     uint8_t numFATBlock;
-    int8_t unused[4079];
+    //fields below are zero in the legacy layout
+    uint8_t version;
+    //blocks of the root directory since FS_VERSION_DIR
+    uint16_t numRootBlock;
+    //layout since FS_VERSION_WIDE
+    uint32_t wideTotalBlock;
+    uint32_t wideRootIndex;
+    uint32_t wideDataStartIndex;
+    uint32_t wideNumDataBlock;
+    uint32_t wideNumFATBlock;
+    //log2 of the block size and filename length, zero in the legacy layout
+    uint8_t blockShift;
+    uint8_t nameLen;
+    int8_t unused[BLOCK_SIZE - 42];
 }sBlock;
 
 typedef sBlock* sBlock_t;
 
+//root directory entry in memory and since FS_VERSION_WIDE
 typedef struct __attribute__((__packed__)) entryOfRootDirectory{
-    char filename[16];
+    char filename[FS_FILENAME_LEN];
+    uint64_t size;
+    uint32_t startIndex;
+    int8_t unused[4];
+}fileInfo;
+
+typedef fileInfo* fileInfo_t;
+
+//root directory entry of the 16-bit formats
+typedef struct __attribute__((__packed__)) narrowEntryOfRootDirectory{
+    char filename[NARROW_NAME_LEN];
     uint32_t size;
     uint16_t startIndex;
     int8_t unused[10];
-}fileInfo;
+}narrowInfo;
 
-typedef fileInfo* fileInfo_t;
+_Static_assert(sizeof(sBlock) == BLOCK_SIZE, "the superblock fills a block");
+_Static_assert(BLOCK_SIZE % sizeof(fileInfo) == 0,
+               "FS_FILENAME_LEN + 16 must divide FS_BLOCK_SIZE");
+_Static_assert(FS_FILENAME_LEN <= UINT8_MAX, "FS_FILENAME_LEN is recorded in a byte");
 
 //whenever we create a file descriptor
 //we will buffer data of that file
 typedef struct file_descriptor{
+    //held during every operation on this fd, protects the
+    //fields below. Positional operations only read fileID
+    //and share it.
+    pthread_rwlock_t lock;
     int fileID;
     size_t offset;
+    //cached position in the FAT chain, so that sequential
+    //access does not walk the chain from startIndex every time
+    size_t curBlock;
+    uint32_t curIndex;
+    //read-ahead state of fs_read: the block after the last one
+    //the previous read touched, the end of the blocks already
+    //prefetched and how many blocks are kept ahead of the
+    //reader (0 after a random access)
+    size_t raNext;
+    size_t raEnd;
+    size_t raWindow;
+    //write buffer, NULL unless enabled by fs_set_write_buffer.
+    //It holds wbLen bytes to be written at wbStart, all in
+    //one block, and offset already counts them.
+    char *wbBuf;
+    size_t wbStart;
+    size_t wbLen;
+    //block requests of fs_aio_* calls on this fd not
+    //reaped yet, under aioLock. fs_close waits for them.
+    size_t aioPending;
 }fileDes;
 
 typedef fileDes* fileDes_t;
 
-typedef struct virtualDisk{
-    sBlock_t superBlock;
-    uint16_t *arrFAT;
+//request of fs_aio_read and fs_aio_write
+typedef struct asyncRequest{
+    bool used;
+    //all of its block requests completed
+    bool done;
+    //a thread waits for it in fs_aio_wait, which
+    //collects it, fs_aio_poll leaves it alone
+    bool claimed;
+    //where its block requests go
+    int fd;
+    int fileID;
+    bool write;
+    //bytes transferred, -1 if a block request failed
+    int result;
+    //block requests not completed yet
+    size_t pendingIO;
+    fs_aio_cb callback;
+    void *arg;
+    int nextFree;
+}aioReq;
+
+//file descriptors are allocated in chunks of FD_CHUNK, one
+//word of the free bitmap each, so that the table can grow
+//without moving descriptors that other threads are using
+#define FD_CHUNK MAP_WORD_BITS
+#define FD_CHUNKS (FS_OPEN_MAX_COUNT / FD_CHUNK)
+_Static_assert(FS_OPEN_MAX_COUNT % FD_CHUNK == 0, "FS_OPEN_MAX_COUNT must be a multiple of 64");
+//words of the summary bitmap, one bit per chunk
+#define FD_SUMMARY_WORDS MAP_WORDS(FD_CHUNKS)
+
+//handle used by the synchronous paths
+#define NO_AIO -1
+//number of completions collected from the block layer at once
+#define AIO_REAP_BATCH 32
+
+/*
+ * Locks, always taken in this order:
+ *      rootLock, FDT[fd].lock, fileLock[fileID], fdtLock,
+ *      fatLock, metaLock, aioLock
+ * the buffer cache and the block layer lock themselves.
+ *
+ * size and startIndex of a root directory entry are written
+ * with both the file lock and metaLock held, so readers need
+ * either of them. Names are written with rootLock and metaLock.
+ * Mount and unmount must not race with anything else.
+ */
+typedef struct fs_instance{
+    //virtual disk the file system lives on
+    struct disk *blockDisk;
+    //layout of the disk, from the superblock
+    size_t totalBlock;
+    size_t rootIndex;
+    size_t dataStartIndex;
+    size_t numDataBlock;
+    size_t numFATBlock;
+    //16-bit FAT entries and 32-bit sizes on the disk. Memory
+    //always holds 32-bit entries and 64-bit sizes, they are
+    //converted when metadata is read and written.
+    bool narrow;
+    //FAT entries per FAT block on the disk
+    size_t fatPerBlock;
+    //metadata blocks converted for the disk, protected by metaLock
+    void *packBuf;
+    uint32_t *arrFAT;
     fileInfo_t rootDir;
-    fileDes_t FDT;
-    int freeFd;
+    //blocks and entries of the root directory
+    size_t numRootBlock;
+    int numEntries;
+    //FDT chunks, set once by alloc_fd and read without fdtLock
+    fileDes_t FDT[FD_CHUNKS];
+    int numFDTChunk;
+    //one bit per descriptor of the allocated chunks, set if it is free
+    uint64_t freeFd[FD_CHUNKS];
+    //one bit per chunk, set if it has a free descriptor
+    uint64_t freeFdChunk[FD_SUMMARY_WORDS];
+    //descriptors in use
+    int usedFd;
     int freeFATEntries;
     int freeRootEntries;
+    //buffer cache for data blocks
+    bCache *cache;
+    //one bit per FAT entry, set if the entry is free
+    uint64_t *freeMap;
+    //where the next allocation starts looking (next-fit)
+    uint32_t nextFree;
+    //last block of each file, indexed by fileID
+    uint32_t *tailOf;
+    //one bit per FAT block, set if it differs from the disk
+    uint64_t *dirtyFAT;
+    //one bit per root directory block, set if it differs from the disk
+    uint64_t *dirtyRoot;
+    //metadata changes since the last commit
+    size_t pendingOps;
+    //spans handed out by fs_read_view and not released yet
+    size_t views;
+    //asynchronous requests, indexed by handle
+    aioReq *aio;
+    int aioCap;
+    int aioFree;
+    //handles not collected yet
+    int aioUsed;
+    //block writes of asynchronous requests in flight,
+    //indexed by fileID. Blocks written right away wait
+    //for them, so that older data can not land last.
+    size_t *aioWrites;
+    //open file descriptors of each file, indexed by fileID
+    int *openCount;
+    //filename index with linear probing, each bucket holds
+    //the fileID of a used root directory entry or NO_ENTRY.
+    //The number of buckets is a power of two at least twice
+    //the number of entries, nameMask is one less.
+    int *nameIndex;
+    int nameMask;
+    //no root directory entry below is free
+    int firstFreeEntry;
+    //FDT chunks, freeFd, freeFdChunk, usedFd, openCount and views
+    pthread_mutex_t fdtLock;
+    //names in the root directory, nameIndex, firstFreeEntry
+    //and freeRootEntries
+    pthread_rwlock_t rootLock;
+    //data and size of each file, indexed by fileID
+    pthread_rwlock_t *fileLock;
+    //arrFAT, freeMap, nextFree, tailOf, dirtyFAT and freeFATEntries
+    pthread_mutex_t fatLock;
+    //root directory as written back, dirtyRoot and pendingOps
+    pthread_mutex_t metaLock;
+    //asynchronous request table, aioPending of the
+    //fds and aioWrites
+    pthread_mutex_t aioLock;
+    //a thread waits for completions in the block layer
+    bool aioReaping;
+    pthread_cond_t aioReaped;
 }vDisk;
 
-static vDisk disk = {.superBlock = NULL,
-                        .arrFAT = NULL,
-                        .rootDir = NULL,
-                        .FDT = NULL};
+//file system used by the fs_* functions, NULL if not mounted
+static vDisk *defaultDisk = NULL;
 
-int fs_mount(const char *diskname)
+//capacity of the buffer cache created by the next fs_mount
+static size_t cacheBlocks = CACHE_DEFAULT_BLOCKS;
+
+//how get_new_block picks free blocks
+static int allocMode = FS_ALLOC_NEXT_FIT;
+
+int fs_set_alloc_mode(int mode)
 {
-	if(block_disk_open(diskname))
-	    return -1;
+    if(mode != FS_ALLOC_NEXT_FIT && mode != FS_ALLOC_EXTENT)
+        return -1;
+    allocMode = mode;
+    return 0;
+}
+
+//when root directory and FAT changes reach the disk
+static int metaMode = FS_META_SYNC;
+//commit delayed metadata after that many changes, 0 for never
+static size_t metaMaxOps = 0;
+
+int fs_set_meta_mode(int mode, size_t maxOps)
+{
+    if((mode & ~FS_META_SYNC_ON_CLOSE) != FS_META_SYNC
+        && (mode & ~FS_META_SYNC_ON_CLOSE) != FS_META_DELAYED)
+        return -1;
+    metaMode = mode;
+    metaMaxOps = maxOps;
+    return 0;
+}
+
+int commit_metadata(vDisk *disk);
+void count_block_request(vDisk *disk, aioReq *req, int delta);
+int find_name(vDisk *disk, const char *filename);
+int flush_write_buffer(vDisk *disk, fileDes_t file);
+fileDes_t get_fd(vDisk *disk, int fd);
+int lock_fd(vDisk *disk, int fd, bool shared);
+int reap_aio(vDisk *disk, bool wait);
+void unlock_fd(vDisk *disk, int fd);
+int wait_file_writes(vDisk *disk, int fileID);
+
+int fs_set_cache_size(size_t nblocks)
+{
+    if(defaultDisk)
+        return -1;
+    cacheBlocks = nblocks;
+    return 0;
+}
 
-	sBlock_t superBlock = malloc(BLOCK_SIZE);
-	if(!superBlock){
-	    die_perror("malloc");
-	}
-	block_read(0, superBlock);
-
-	//error-checking super block
-	uint16_t correctFATBlock = BLOCK_NUM(2 * superBlock->numDataBlock);
-	uint16_t correctDataBlock = block_disk_count() - correctFATBlock - 2;
-    //change char array to string
-	char *tmp = malloc(9);
-    memcpy(tmp, superBlock->signature,8);
-    tmp[8] = '\0';
-	if(strcmp(tmp, SIGNATURE) != 0
-	    || superBlock->totalBlock != block_disk_count()
-	    || superBlock->numFATBlock != correctFATBlock
-	    || superBlock->numDataBlock != correctDataBlock
-	    || superBlock->rootIndex != correctFATBlock + 1
-	    || superBlock->dataStartIndex != superBlock->rootIndex + 1)
+/*
+ * read the superblock of @disk and check that it
+ * describes a valid layout for a disk of its size
+ * Return:
+ *      0 if valid
+ *      -1 if not
+ */
+int load_superblock(vDisk *disk)
+{
+    sBlock_t superBlock = malloc(BLOCK_SIZE);
+    if(!superBlock)
+        die_perror("malloc");
+    //disks keep the block size and filename length
+    //they were formatted with, they must match ours
+    if(bdisk_read(disk->blockDisk, 0, superBlock)
+        || memcmp(superBlock->signature, SIGNATURE, 8) != 0
+        || superBlock->version > FS_VERSION_WIDE
+        || (superBlock->blockShift ? superBlock->blockShift : LEGACY_BLOCK_SHIFT) != BLOCK_SHIFT
+        || (superBlock->nameLen ? superBlock->nameLen : NARROW_NAME_LEN) != FS_FILENAME_LEN)
     {
-	    free(tmp);
-	    free(superBlock);
-	    return -1;
+        free(superBlock);
+        return -1;
+    }
+    disk->narrow = superBlock->version < FS_VERSION_WIDE;
+    disk->numRootBlock = 1;
+    if(superBlock->version >= FS_VERSION_DIR)
+        disk->numRootBlock = superBlock->numRootBlock;
+    if(disk->narrow){
+        disk->totalBlock = superBlock->totalBlock;
+        disk->rootIndex = superBlock->rootIndex;
+        disk->dataStartIndex = superBlock->dataStartIndex;
+        disk->numDataBlock = superBlock->numDataBlock;
+        disk->numFATBlock = superBlock->numFATBlock;
+    } else {
+        disk->totalBlock = superBlock->wideTotalBlock;
+        disk->rootIndex = superBlock->wideRootIndex;
+        disk->dataStartIndex = superBlock->wideDataStartIndex;
+        disk->numDataBlock = superBlock->wideNumDataBlock;
+        disk->numFATBlock = superBlock->wideNumFATBlock;
     }
-	free(tmp);
+    disk->fatPerBlock = BLOCK_SIZE / FAT_ENTRY_SIZE(disk->narrow);
+    free(superBlock);
+
+    //error-checking super block
+    size_t correctFATBlock = BLOCK_NUM(disk->numDataBlock * FAT_ENTRY_SIZE(disk->narrow));
+    if(disk->totalBlock != bdisk_count(disk->blockDisk)
+        || !disk->numRootBlock || !disk->numDataBlock
+        || disk->numDataBlock >= FAT_EOC
+        || disk->numFATBlock != correctFATBlock
+        || disk->totalBlock != correctFATBlock + disk->numRootBlock + disk->numDataBlock + 1
+        || disk->rootIndex != correctFATBlock + 1
+        || disk->dataStartIndex != disk->rootIndex + disk->numRootBlock)
+        return -1;
+    return 0;
+}
 
-	//read File Allocation Table
-	//arrFAT should have the same size as the total numFATBlock
-	uint16_t *arrFAT = malloc(superBlock->numFATBlock * BLOCK_SIZE);
-	if(!arrFAT){
-	    free(superBlock);
-	    die_perror("malloc");
-	}
+/*
+ * read the File Allocation Table of @disk, widening 16-bit
+ * entries, and build the free block bitmap
+ * Return:
+ *      0 if valid
+ *      -1 if not
+ */
+int load_fat(vDisk *disk)
+{
+    //arrFAT holds every entry of the FAT blocks
+    size_t numEntry = disk->numFATBlock * disk->fatPerBlock;
+    disk->arrFAT = malloc(numEntry * sizeof(uint32_t));
+    disk->freeMap = calloc(MAP_WORDS(disk->numDataBlock), sizeof(uint64_t));
+    if(!disk->arrFAT || !disk->freeMap)
+        die_perror("malloc");
 
-    for (int i = 0; i < superBlock->numFATBlock; ++i)
-        block_read(i + 1, (char*)arrFAT + i * BLOCK_SIZE);
+    if(disk->narrow){
+        uint16_t *narrowFAT = disk->packBuf;
+        bdisk_read_range(disk->blockDisk, 1, disk->numFATBlock, narrowFAT);
+        for (size_t i = 0; i < numEntry; ++i)
+            disk->arrFAT[i] = narrowFAT[i] == NARROW_EOC ? FAT_EOC : narrowFAT[i];
+    } else {
+        bdisk_read_range(disk->blockDisk, 1, disk->numFATBlock, disk->arrFAT);
+    }
 
     //error check for FAT
-    if(arrFAT[0] != FAT_EOC){
-        free(superBlock);
-        free(arrFAT);
+    if(disk->arrFAT[0] != FAT_EOC)
         return -1;
-    }
 
-    //compute FAT free number
-    int freeFATEntries = 0;
-    for (int k = 0; k < superBlock->numDataBlock; ++k) {
-        if(arrFAT[k] == 0)
-            ++freeFATEntries;
+    //compute FAT free number and build the free block bitmap
+    disk->freeFATEntries = 0;
+    for (size_t k = 0; k < disk->numDataBlock; ++k) {
+        if(disk->arrFAT[k] == 0) {
+            ++disk->freeFATEntries;
+            disk->freeMap[k / MAP_WORD_BITS] |= (uint64_t)1 << (k % MAP_WORD_BITS);
+        }
     }
+    return 0;
+}
 
-    //read root directory
-    fileInfo_t rootDir = malloc(BLOCK_SIZE);
-    if(!rootDir){
-        free(superBlock);
-        free(arrFAT);
+/*
+ * read the root directory of @disk, widening entries
+ * of the 16-bit formats in place
+ * Return:
+ *      0 if valid
+ *      -1 if not
+ */
+int load_root(vDisk *disk)
+{
+    disk->numEntries = disk->numRootBlock * ENTRY_PER_BLOCK;
+    disk->rootDir = malloc(disk->numRootBlock * BLOCK_SIZE);
+    if(!disk->rootDir)
         die_perror("malloc");
-    }
-    block_read(superBlock->rootIndex, rootDir);
+    bdisk_read_range(disk->blockDisk, disk->rootIndex, disk->numRootBlock, disk->rootDir);
 
     //error check for root directory
     //compute root directory free number
-    int freeRootEntries = 0;
-    for (int j = 0; j < FS_FILE_MAX_COUNT; ++j) {
-        if(rootDir[j].filename[0] == '\0') {
-            ++freeRootEntries;
+    disk->freeRootEntries = 0;
+    for (int j = 0; j < disk->numEntries; ++j) {
+        fileInfo_t entry = &disk->rootDir[j];
+        if(disk->narrow){
+            //both entries have the same size
+            narrowInfo old;
+            memcpy(&old, entry, sizeof(old));
+            memset(entry, 0, sizeof(fileInfo));
+            memcpy(entry->filename, old.filename, NARROW_NAME_LEN);
+            entry->size = old.size;
+            entry->startIndex = old.startIndex == NARROW_EOC ? FAT_EOC : old.startIndex;
+        }
+        if(entry->filename[0] == '\0') {
+            ++disk->freeRootEntries;
             continue;
         }
         //if rootDir[j] is not an empty entry
         //and its entries have the correct format
-        if((rootDir[j].size > 0 && rootDir[j].startIndex != FAT_EOC)
-            || (rootDir[j].size == 0 && rootDir[j].startIndex == FAT_EOC))
+        if((entry->size > 0 && entry->startIndex != FAT_EOC)
+            || (entry->size == 0 && entry->startIndex == FAT_EOC))
             continue;
-
-        free(superBlock);
-        free(arrFAT);
-        free(rootDir);
         return -1;
     }
+    return 0;
+}
 
-    //create FDT and initialize them
-    fileDes_t FDT = malloc(FS_OPEN_MAX_COUNT * sizeof(fileDes));
-    if(!FDT){
-        free(rootDir);
-        free(superBlock);
-        free(arrFAT);
-        die_perror("malloc");
+/*
+ * free the tables of @disk, close its virtual disk
+ * if it is still open and free @disk itself
+ */
+void free_instance(vDisk *disk)
+{
+    if(disk->blockDisk)
+        bdisk_close(disk->blockDisk);
+    free(disk->arrFAT);
+    free(disk->rootDir);
+    free(disk->packBuf);
+    for (int c = 0; c < disk->numFDTChunk; ++c)
+        free(disk->FDT[c]);
+    free(disk->openCount);
+    free(disk->nameIndex);
+    free(disk->freeMap);
+    free(disk->tailOf);
+    free(disk->dirtyFAT);
+    free(disk->dirtyRoot);
+    free(disk->fileLock);
+    free(disk->aio);
+    free(disk->aioWrites);
+    free(disk);
+}
+
+vDisk *fsi_mount(const char *diskname)
+{
+    vDisk *disk = calloc(1, sizeof(vDisk));
+    if(!disk)
+        die_perror("calloc");
+    disk->blockDisk = bdisk_open(diskname);
+    if(!disk->blockDisk){
+        free(disk);
+        return NULL;
     }
-    for (int l = 0; l < FS_OPEN_MAX_COUNT; ++l){
-        //we use -1 indicates that entry is free
-        FDT[l].fileID = -1;
-        FDT[l].offset = 0;
+
+    if(load_superblock(disk)){
+        free_instance(disk);
+        return NULL;
+    }
+    //metadata of the 16-bit formats is narrowed here before being written
+    if(disk->narrow){
+        size_t packBlocks = disk->numFATBlock > disk->numRootBlock ? disk->numFATBlock : disk->numRootBlock;
+        disk->packBuf = malloc(packBlocks * BLOCK_SIZE);
+        if(!disk->packBuf)
+            die_perror("malloc");
+    }
+    if(load_fat(disk) || load_root(disk)){
+        free_instance(disk);
+        return NULL;
+    }
+
+    int numEntries = disk->numEntries;
+    disk->tailOf = malloc(numEntries * sizeof(uint32_t));
+    disk->dirtyFAT = calloc(MAP_WORDS(disk->numFATBlock), sizeof(uint64_t));
+    disk->dirtyRoot = calloc(MAP_WORDS(disk->numRootBlock), sizeof(uint64_t));
+    disk->openCount = calloc(numEntries, sizeof(int));
+    disk->aioWrites = calloc(numEntries, sizeof(size_t));
+    disk->fileLock = malloc(numEntries * sizeof(pthread_rwlock_t));
+    int nameBuckets = 1;
+    while(nameBuckets < 2 * numEntries)
+        nameBuckets *= 2;
+    disk->nameIndex = malloc(nameBuckets * sizeof(int));
+    if(!disk->tailOf || !disk->dirtyFAT || !disk->dirtyRoot
+        || !disk->openCount || !disk->aioWrites || !disk->fileLock || !disk->nameIndex)
+        die_perror("malloc");
+    //tails are found lazily on the first append
+    for (int m = 0; m < numEntries; ++m) {
+        disk->tailOf[m] = TAIL_UNKNOWN;
+        pthread_rwlock_init(&disk->fileLock[m], NULL);
     }
 
-    //initialize global variable disk
-    disk.superBlock = superBlock;
-    disk.arrFAT = arrFAT;
-    disk.rootDir = rootDir;
-    disk.FDT = FDT;
-    disk.freeFd = FS_OPEN_MAX_COUNT;
-    disk.freeFATEntries = freeFATEntries;
-    disk.freeRootEntries = freeRootEntries;
+    pthread_mutex_init(&disk->fdtLock, NULL);
+    pthread_rwlock_init(&disk->rootLock, NULL);
+    pthread_mutex_init(&disk->fatLock, NULL);
+    pthread_mutex_init(&disk->metaLock, NULL);
+    pthread_mutex_init(&disk->aioLock, NULL);
+    pthread_cond_init(&disk->aioReaped, NULL);
+
+    //initialize the rest of the file system instance
+    //the FDT grows on the first fs_open
+    disk->numFDTChunk = 0;
+    disk->usedFd = 0;
+    disk->cache = cache_create(disk->blockDisk, cacheBlocks, bdisk_count(disk->blockDisk));
+    disk->nextFree = 1;
+    disk->pendingOps = 0;
+    disk->views = 0;
+    disk->aio = NULL;
+    disk->aioCap = 0;
+    disk->aioFree = NO_AIO;
+    disk->aioUsed = 0;
+    disk->aioReaping = false;
+    disk->firstFreeEntry = 0;
+
+    //index every used entry, a name found twice
+    //resolves to its first entry like a linear scan
+    disk->nameMask = nameBuckets - 1;
+    for (int b = 0; b < nameBuckets; ++b)
+        disk->nameIndex[b] = NO_ENTRY;
+    for (int n = 0; n < numEntries; ++n) {
+        if(disk->rootDir[n].filename[0] == '\0')
+            continue;
+        int bucket = find_name(disk, disk->rootDir[n].filename);
+        if(disk->nameIndex[bucket] == NO_ENTRY)
+            disk->nameIndex[bucket] = n;
+    }
 
-    return 0;
+    return disk;
 }
 
-int fs_umount(void)
+int fsi_umount(vDisk *disk)
 {
-    //no virtual disk is opened or disk close fail
-    if(!disk.superBlock || disk.freeFd < FS_OPEN_MAX_COUNT || block_disk_close())
+    //no virtual disk is opened, or there are still open files,
+    //views pointing into the disk mapping or async requests
+    if(!disk || disk->usedFd || disk->views || disk->aioUsed)
         return -1;
 
+    //delayed metadata and dirty data blocks must reach the
+    //disk before we close it. The disk is gone even if it
+    //failed to close, the next call only frees the rest.
+    if(disk->blockDisk){
+        if(commit_metadata(disk) || cache_flush(disk->cache))
+            return -1;
+        int ret = bdisk_close(disk->blockDisk);
+        disk->blockDisk = NULL;
+        if(ret)
+            return -1;
+    }
+
     //free everything and quit
-    free(disk.superBlock);
-    free(disk.arrFAT);
-    free(disk.rootDir);
-    free(disk.FDT);
-    disk.superBlock = NULL;
-    disk.arrFAT = NULL;
-    disk.rootDir = NULL;
-    disk.FDT = NULL;
+    cache_destroy(disk->cache);
+    for (int c = 0; c < disk->numFDTChunk; ++c)
+        for (int i = 0; i < FD_CHUNK; ++i)
+            pthread_rwlock_destroy(&disk->FDT[c][i].lock);
+    for (int j = 0; j < disk->numEntries; ++j)
+        pthread_rwlock_destroy(&disk->fileLock[j]);
+    pthread_mutex_destroy(&disk->fdtLock);
+    pthread_rwlock_destroy(&disk->rootLock);
+    pthread_mutex_destroy(&disk->fatLock);
+    pthread_mutex_destroy(&disk->metaLock);
+    pthread_mutex_destroy(&disk->aioLock);
+    pthread_cond_destroy(&disk->aioReaped);
+    free_instance(disk);
     return 0;
 }
 
-int fs_info(void)
+int fs_format(const char *diskname, size_t nfiles)
+{
+    struct disk *blockDisk = bdisk_open(diskname);
+    if(!blockDisk)
+        return -1;
+
+    //16-bit block indices as long as they can address
+    //the disk, their entries only hold short filenames
+    size_t totalBlock = bdisk_count(blockDisk);
+    bool narrow = totalBlock <= UINT16_MAX && FS_FILENAME_LEN == NARROW_NAME_LEN;
+    size_t fatPerBlock = BLOCK_SIZE / FAT_ENTRY_SIZE(narrow);
+
+    //the largest data area that fits next to the
+    //superblock, the FAT and the root directory
+    //counted in entries, nfiles * sizeof(fileInfo) may not fit
+    size_t numRootBlock = nfiles / ENTRY_PER_BLOCK + (nfiles % ENTRY_PER_BLOCK != 0);
+    if(!numRootBlock)
+        numRootBlock = 1;
+    size_t numDataBlock = 0;
+    if(totalBlock > numRootBlock + 2)
+        numDataBlock = (totalBlock - numRootBlock - 1) * fatPerBlock / (fatPerBlock + 1);
+    while(numDataBlock && numDataBlock + BLOCK_NUM(numDataBlock * FAT_ENTRY_SIZE(narrow))
+                          + numRootBlock + 1 > totalBlock)
+        --numDataBlock;
+    size_t numFATBlock = BLOCK_NUM(numDataBlock * FAT_ENTRY_SIZE(narrow));
+    //the root directory takes the block the FAT may leave over
+    numRootBlock = totalBlock - numDataBlock - numFATBlock - 1;
+    if(!numDataBlock || numDataBlock >= FAT_EOC || !numRootBlock || numRootBlock > UINT16_MAX){
+        bdisk_close(blockDisk);
+        return -1;
+    }
+
+    sBlock_t superBlock = calloc(1, BLOCK_SIZE);
+    char *block = calloc(1, BLOCK_SIZE);
+    if(!superBlock || !block)
+        die_perror("calloc");
+    memcpy(superBlock->signature, SIGNATURE, 8);
+    superBlock->numRootBlock = numRootBlock;
+    superBlock->blockShift = BLOCK_SHIFT;
+    superBlock->nameLen = FS_FILENAME_LEN;
+    if(narrow){
+        superBlock->version = FS_VERSION_DIR;
+        superBlock->totalBlock = totalBlock;
+        superBlock->rootIndex = numFATBlock + 1;
+        superBlock->dataStartIndex = numFATBlock + 1 + numRootBlock;
+        superBlock->numDataBlock = numDataBlock;
+        superBlock->numFATBlock = numFATBlock;
+    } else {
+        superBlock->version = FS_VERSION_WIDE;
+        superBlock->wideTotalBlock = totalBlock;
+        superBlock->wideRootIndex = numFATBlock + 1;
+        superBlock->wideDataStartIndex = numFATBlock + 1 + numRootBlock;
+        superBlock->wideNumDataBlock = numDataBlock;
+        superBlock->wideNumFATBlock = numFATBlock;
+    }
+
+    //the first FAT entry is reserved, everything
+    //else in the FAT and the root directory is zero
+    int ret = bdisk_write(blockDisk, 0, superBlock);
+    memset(block, 0xFF, FAT_ENTRY_SIZE(narrow));
+    for (size_t i = 1; !ret && i < numFATBlock + 1 + numRootBlock; ++i) {
+        ret = bdisk_write(blockDisk, i, block);
+        memset(block, 0, FAT_ENTRY_SIZE(narrow));
+    }
+    if(!ret)
+        ret = bdisk_sync(blockDisk);
+    free(superBlock);
+    free(block);
+    if(bdisk_close(blockDisk))
+        ret = -1;
+    return ret;
+}
+
+int fsi_info(vDisk *disk)
 {
-    if(!disk.superBlock) {
+    if(!disk) {
         return -1;
     }
 
+    pthread_rwlock_rdlock(&disk->rootLock);
+    pthread_mutex_lock(&disk->fatLock);
 	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", disk.superBlock->totalBlock);
-	printf("fat_blk_count=%d\n", disk.superBlock->numFATBlock);
-	printf("rdir_blk=%d\n", disk.superBlock->rootIndex);
-	printf("data_blk=%d\n", disk.superBlock->dataStartIndex);
-	printf("data_blk_count=%d\n", disk.superBlock->numDataBlock);
-	printf("fat_free_ratio=%d/%d\n", disk.freeFATEntries, disk.superBlock->numDataBlock);
-	printf("rdir_free_ratio=%d/%d\n", disk.freeRootEntries, FS_FILE_MAX_COUNT);
+	printf("total_blk_count=%zu\n", disk->totalBlock);
+	printf("fat_blk_count=%zu\n", disk->numFATBlock);
+	printf("rdir_blk=%zu\n", disk->rootIndex);
+	printf("data_blk=%zu\n", disk->dataStartIndex);
+	printf("data_blk_count=%zu\n", disk->numDataBlock);
+	printf("fat_free_ratio=%d/%zu\n", disk->freeFATEntries, disk->numDataBlock);
+	printf("rdir_free_ratio=%d/%d\n", disk->freeRootEntries, disk->numEntries);
+    pthread_mutex_unlock(&disk->fatLock);
+    pthread_rwlock_unlock(&disk->rootLock);
     return 0;
 }
 
@@ -237,18 +727,63 @@ int check_filename(const char *filename)
 }
 
 /*
- * check if @filename exists in root directory
+ * FNV-1a hash of @filename, reduced to a bucket of the filename index
+ */
+int hash_name(vDisk *disk, const char *filename)
+{
+    uint32_t hash = 2166136261u;
+    for (; *filename; ++filename) {
+        hash ^= (uint8_t)*filename;
+        hash *= 16777619u;
+    }
+    return hash & disk->nameMask;
+}
+
+/*
+ * return the bucket of the filename index holding @filename,
+ * or the empty bucket where it would be inserted
  *
- * If it exists, return 0.
- * If it does not exist, return -1.
+ * Buckets are never all used since there are at least twice
+ * as many as root directory entries.
  */
-int check_file_exist(const char *filename)
+int find_name(vDisk *disk, const char *filename)
 {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if(strcmp(disk.rootDir[i].filename, filename) == 0)
-            return 0;
+    int bucket = hash_name(disk, filename);
+    while(disk->nameIndex[bucket] != NO_ENTRY
+        && strcmp(disk->rootDir[disk->nameIndex[bucket]].filename, filename) != 0)
+        bucket = (bucket + 1) & disk->nameMask;
+    return bucket;
+}
+
+/*
+ * get the index of @filename in root directory
+ * return -1 if it does not exist
+ */
+int get_file_ID(vDisk *disk, const char *filename)
+{
+    return disk->nameIndex[find_name(disk, filename)];
+}
+
+/*
+ * remove the root directory entry in @bucket from the filename index
+ *
+ * Entries probed past the emptied bucket are shifted back
+ * so that no lookup stops early, no tombstone is needed.
+ */
+void unindex_name(vDisk *disk, int bucket)
+{
+    int hole = bucket;
+    int next = (bucket + 1) & disk->nameMask;
+    while(disk->nameIndex[next] != NO_ENTRY){
+        int home = hash_name(disk, disk->rootDir[disk->nameIndex[next]].filename);
+        //move the entry unless its home lies between the hole and it
+        if(((next - home) & disk->nameMask) >= ((next - hole) & disk->nameMask)){
+            disk->nameIndex[hole] = disk->nameIndex[next];
+            hole = next;
+        }
+        next = (next + 1) & disk->nameMask;
     }
-    return -1;
+    disk->nameIndex[hole] = NO_ENTRY;
 }
 
 /*
@@ -257,14 +792,19 @@ int check_file_exist(const char *filename)
  * are calling this function.
  * If it is full, we return -1 indicates there is no
  * free entry
+ *
+ * The search starts at disk->firstFreeEntry, which
+ * fs_delete lowers when it frees an entry below it.
  */
-int get_first_free_entry()
+int get_first_free_entry(vDisk *disk)
 {
-    assert(disk.freeRootEntries > 0);
+    assert(disk->freeRootEntries > 0);
     int index;
-    for (index = 0; index < FS_FILE_MAX_COUNT; ++index) {
-        if(disk.rootDir[index].filename[0] == '\0')
+    for (index = disk->firstFreeEntry; index < disk->numEntries; ++index) {
+        if(disk->rootDir[index].filename[0] == '\0'){
+            disk->firstFreeEntry = index + 1;
             return index;
+        }
     }
     return -1;
 }
@@ -280,196 +820,538 @@ int get_first_free_entry()
  *      0 if success
  *      -1 if failure
  */
-int write_back(void *buf, size_t block_offset, size_t block_length)
+int write_back(vDisk *disk, void *buf, size_t block_offset, size_t block_length)
 {
-    if(!buf || block_offset < 0 || block_offset >= disk.superBlock->totalBlock
-        || block_offset >= disk.superBlock->totalBlock
-        || block_offset + block_length >= disk.superBlock->totalBlock)
+    if(!buf || block_offset < 0 || block_offset >= disk->totalBlock
+        || block_offset >= disk->totalBlock
+        || block_offset + block_length >= disk->totalBlock)
     {
         return -1;
     }
 
-    for (size_t i = 0; i < block_length; ++i) {
-        block_write(block_offset, buf);
-        ++block_offset;
-        buf = (char *)buf + BLOCK_SIZE;
-    }
+    return bdisk_write_range(disk->blockDisk, block_offset, block_length, buf);
+}
 
-    return 0;
+/*
+ * every change to disk->arrFAT goes through here, so that
+ * we know which FAT blocks have to be written back
+ */
+void set_fat(vDisk *disk, uint32_t index, uint32_t value)
+{
+    size_t block = index / disk->fatPerBlock;
+    disk->arrFAT[index] = value;
+    disk->dirtyFAT[block / MAP_WORD_BITS] |= (uint64_t)1 << (block % MAP_WORD_BITS);
 }
 
-int fs_create(const char *filename)
+/*
+ * mark the root directory block holding entry @fileID
+ * as changed, the caller holds metaLock
+ */
+void set_root_dirty(vDisk *disk, int fileID)
 {
-    if(!disk.superBlock || disk.freeRootEntries <= 0
-        || check_filename(filename) || !check_file_exist(filename))
-    {
-        return -1;
+    size_t block = fileID / ENTRY_PER_BLOCK;
+    disk->dirtyRoot[block / MAP_WORD_BITS] |= (uint64_t)1 << (block % MAP_WORD_BITS);
+}
+
+/*
+ * convert FAT blocks [@start, @end) to 16-bit entries
+ * in disk->packBuf and return it
+ */
+void *pack_fat(vDisk *disk, size_t start, size_t end)
+{
+    uint16_t *narrowFAT = disk->packBuf;
+    uint32_t *fat = disk->arrFAT + start * disk->fatPerBlock;
+    for (size_t i = 0; i < (end - start) * disk->fatPerBlock; ++i)
+        narrowFAT[i] = fat[i] == FAT_EOC ? NARROW_EOC : fat[i];
+    return narrowFAT;
+}
+
+/*
+ * convert root directory blocks [@start, @end) to
+ * 16-bit format entries in disk->packBuf and return it
+ */
+void *pack_root(vDisk *disk, size_t start, size_t end)
+{
+    narrowInfo *narrowDir = disk->packBuf;
+    fileInfo_t dir = disk->rootDir + start * ENTRY_PER_BLOCK;
+    memset(narrowDir, 0, (end - start) * BLOCK_SIZE);
+    for (size_t i = 0; i < (end - start) * ENTRY_PER_BLOCK; ++i) {
+        memcpy(narrowDir[i].filename, dir[i].filename, NARROW_NAME_LEN);
+        narrowDir[i].size = dir[i].size;
+        narrowDir[i].startIndex = dir[i].startIndex == FAT_EOC ? NARROW_EOC : dir[i].startIndex;
     }
+    return narrowDir;
+}
 
-    int fileID = get_first_free_entry();
-    strcpy(disk.rootDir[fileID].filename, filename);
-    disk.rootDir[fileID].size = 0;
-    disk.rootDir[fileID].startIndex = FAT_EOC;
+/*
+ * write the blocks of @data marked in @dirty back into the disk,
+ * @data has @numBlock blocks and starts at block @firstBlock,
+ * consecutive dirty blocks are written together. If @pack
+ * is not NULL, it converts them to the format of the disk.
+ * Return:
+ *      0 if success
+ *      -1 if failure
+ */
+int flush_dirty(vDisk *disk, uint64_t *dirty, void *data, size_t numBlock, size_t firstBlock,
+                void *(*pack)(vDisk *disk, size_t start, size_t end))
+{
+    size_t start = 0;
 
-    --disk.freeRootEntries;
+    while(start < numBlock){
+        if(!(dirty[start / MAP_WORD_BITS] & ((uint64_t)1 << (start % MAP_WORD_BITS)))){
+            ++start;
+            continue;
+        }
+        size_t end = start;
+        while(end < numBlock
+              && (dirty[end / MAP_WORD_BITS] & ((uint64_t)1 << (end % MAP_WORD_BITS))))
+        {
+            dirty[end / MAP_WORD_BITS] &= ~((uint64_t)1 << (end % MAP_WORD_BITS));
+            ++end;
+        }
+        void *buf = pack ? pack(disk, start, end) : (char *)data + start * BLOCK_SIZE;
+        if(write_back(disk, buf, firstBlock + start, end - start))
+            return -1;
+        start = end;
+    }
+    return 0;
+}
 
-    assert(!write_back(disk.rootDir, disk.superBlock->rootIndex, 1));
-	return 0;
+/*
+ * write the root directory and the dirty FAT
+ * blocks back into the disk, if they changed
+ * Return:
+ *      0 if success
+ *      -1 if failure
+ */
+int commit_metadata(vDisk *disk)
+{
+    int ret = 0;
+    pthread_mutex_lock(&disk->fatLock);
+    pthread_mutex_lock(&disk->metaLock);
+    if(flush_dirty(disk, disk->dirtyRoot, disk->rootDir, disk->numRootBlock,
+                   disk->rootIndex, disk->narrow ? pack_root : NULL)
+        || flush_dirty(disk, disk->dirtyFAT, disk->arrFAT, disk->numFATBlock,
+                       1, disk->narrow ? pack_fat : NULL))
+        ret = -1;
+    if(!ret)
+        disk->pendingOps = 0;
+    pthread_mutex_unlock(&disk->metaLock);
+    pthread_mutex_unlock(&disk->fatLock);
+    return ret;
 }
 
 /*
- * check if @filename is opened
- *
- * If it is opened, return 0.
- * If it is not opened, return -1.
+ * called after every operation that changed the root
+ * directory or the FAT. In FS_META_SYNC mode we commit
+ * right away, in delayed mode only once enough changes
+ * piled up (if a limit was set).
  */
-int check_file_open(const char *filename)
+int metadata_changed(vDisk *disk)
 {
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i){
-        if(disk.FDT[i].fileID == -1)
-            continue;
+    if(!(metaMode & FS_META_DELAYED))
+        return commit_metadata(disk);
+
+    pthread_mutex_lock(&disk->metaLock);
+    size_t pendingOps = ++disk->pendingOps;
+    pthread_mutex_unlock(&disk->metaLock);
+    if(metaMaxOps && pendingOps >= metaMaxOps)
+        return commit_metadata(disk);
+    return 0;
+}
 
-        int fid = disk.FDT[i].fileID;
-        if(strcmp(disk.rootDir[fid].filename, filename) == 0)
-            return 0;
+int fsi_sync(vDisk *disk)
+{
+    if(!disk)
+        return -1;
+
+    //write buffers of open fds first
+    int ret = 0;
+    pthread_mutex_lock(&disk->fdtLock);
+    int numFd = disk->numFDTChunk * FD_CHUNK;
+    pthread_mutex_unlock(&disk->fdtLock);
+    for (int fd = 0; fd < numFd; ++fd) {
+        if(lock_fd(disk, fd, false))
+            continue;
+        if(flush_write_buffer(disk, get_fd(disk, fd)))
+            ret = -1;
+        unlock_fd(disk, fd);
     }
-    return -1;
+
+    if(ret || commit_metadata(disk) || cache_flush(disk->cache))
+        return -1;
+    return bdisk_sync(disk->blockDisk);
 }
 
-int get_file_ID(const char *filename)
+int fsi_create(vDisk *disk, const char *filename)
 {
-    int fileID;
-    for (fileID = 0; fileID < FS_FILE_MAX_COUNT; ++fileID) {
-        if(strcmp(disk.rootDir[fileID].filename, filename) == 0)
-            break;
+    if(!disk || check_filename(filename))
+        return -1;
+
+    pthread_rwlock_wrlock(&disk->rootLock);
+    int bucket = find_name(disk, filename);
+    if(disk->freeRootEntries <= 0 || disk->nameIndex[bucket] != NO_ENTRY){
+        pthread_rwlock_unlock(&disk->rootLock);
+        return -1;
     }
-    return fileID;
+
+    int fileID = get_first_free_entry(disk);
+    disk->nameIndex[bucket] = fileID;
+    pthread_mutex_lock(&disk->fatLock);
+    disk->tailOf[fileID] = FAT_EOC;
+    pthread_mutex_unlock(&disk->fatLock);
+
+    pthread_mutex_lock(&disk->metaLock);
+    strcpy(disk->rootDir[fileID].filename, filename);
+    disk->rootDir[fileID].size = 0;
+    disk->rootDir[fileID].startIndex = FAT_EOC;
+    set_root_dirty(disk, fileID);
+    pthread_mutex_unlock(&disk->metaLock);
+
+    --disk->freeRootEntries;
+    pthread_rwlock_unlock(&disk->rootLock);
+
+    //the file exists either way, only its entry may not be on disk
+    if(metadata_changed(disk))
+        return -1;
+    return 0;
 }
 
-int fs_delete(const char *filename)
+int fsi_delete(vDisk *disk, const char *filename)
 {
-    if(!disk.superBlock || check_filename(filename)
-        || check_file_exist(filename) || !check_file_open(filename))
-    {
+    if(!disk || check_filename(filename))
         return -1;
-    }
 
+    pthread_rwlock_wrlock(&disk->rootLock);
     //get index of @filename in root directory
-    int fileID = get_file_ID(filename);
-    assert(fileID < FS_FILE_MAX_COUNT);
+    int bucket = find_name(disk, filename);
+    int fileID = disk->nameIndex[bucket];
+    if(fileID < 0){
+        pthread_rwlock_unlock(&disk->rootLock);
+        return -1;
+    }
 
-    //empty root directory entry
-    disk.rootDir[fileID].filename[0] = '\0';
+    //an open file can not be deleted, nor one whose blocks
+    //asynchronous writes may still land on
+    pthread_mutex_lock(&disk->fdtLock);
+    int openCount = disk->openCount[fileID];
+    pthread_mutex_unlock(&disk->fdtLock);
+    if(openCount || __atomic_load_n(&disk->aioWrites[fileID], __ATOMIC_ACQUIRE)){
+        pthread_rwlock_unlock(&disk->rootLock);
+        return -1;
+    }
 
     //free FAT entries
-    uint16_t next = disk.rootDir[fileID].startIndex;
-    uint16_t tmp;
+    pthread_mutex_lock(&disk->fatLock);
+    uint32_t next = disk->rootDir[fileID].startIndex;
+    uint32_t tmp;
     while(next != FAT_EOC){
-        tmp = disk.arrFAT[next];
-        disk.arrFAT[next] = 0;
+        tmp = disk->arrFAT[next];
+        set_fat(disk, next, 0);
+        disk->freeMap[next / MAP_WORD_BITS] |= (uint64_t)1 << (next % MAP_WORD_BITS);
         next = tmp;
-        ++disk.freeFATEntries;
+        ++disk->freeFATEntries;
     }
+    disk->tailOf[fileID] = TAIL_UNKNOWN;
 
-    ++disk.freeRootEntries;
-
-    assert(!write_back(disk.rootDir, disk.superBlock->rootIndex, 1));
-    assert(!write_back(disk.arrFAT, 1, disk.superBlock->numFATBlock));
+    //empty root directory entry
+    unindex_name(disk, bucket);
+    pthread_mutex_lock(&disk->metaLock);
+    disk->rootDir[fileID].filename[0] = '\0';
+    set_root_dirty(disk, fileID);
+    pthread_mutex_unlock(&disk->metaLock);
+    pthread_mutex_unlock(&disk->fatLock);
+
+    ++disk->freeRootEntries;
+    if(fileID < disk->firstFreeEntry)
+        disk->firstFreeEntry = fileID;
+    pthread_rwlock_unlock(&disk->rootLock);
+
+    if(metadata_changed(disk))
+        return -1;
     return 0;
 }
 
 
-int fs_ls(void)
+int fsi_ls(vDisk *disk)
 {
-	if(!disk.superBlock)
+	if(!disk)
 	    return -1;
 
+    pthread_rwlock_rdlock(&disk->rootLock);
+    pthread_mutex_lock(&disk->metaLock);
 	printf("FS LS:\n");
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if(disk.rootDir[i].filename[0] == '\0')
+    for (int i = 0; i < disk->numEntries; ++i) {
+        if(disk->rootDir[i].filename[0] == '\0')
             continue;
-        printf("file: %s, size: %d, data_blk: %d\n",
-                disk.rootDir[i].filename, disk.rootDir[i].size, disk.rootDir[i].startIndex);
+        //print the first block as the disk stores it
+        uint32_t startIndex = disk->rootDir[i].startIndex;
+        if(disk->narrow && startIndex == FAT_EOC)
+            startIndex = NARROW_EOC;
+        printf("file: %s, size: %" PRIu64 ", data_blk: %" PRIu32 "\n",
+                disk->rootDir[i].filename, disk->rootDir[i].size, startIndex);
     }
+    pthread_mutex_unlock(&disk->metaLock);
+    pthread_rwlock_unlock(&disk->rootLock);
     return 0;
 }
 
-int fs_open(const char *filename)
+/*
+ * return the descriptor @fd of an allocated chunk
+ */
+fileDes_t get_fd(vDisk *disk, int fd)
 {
-    if(!disk.superBlock || check_filename(filename)
-        || check_file_exist(filename) || !disk.freeFd)
-    {
+    return &disk->FDT[fd / FD_CHUNK][fd % FD_CHUNK];
+}
+
+/*
+ * take the lowest free file descriptor, the caller holds fdtLock
+ *
+ * The lowest chunk with a free descriptor is found in the
+ * summary bitmap and the descriptor in its word, so this takes
+ * constant time. If every chunk is full, the FDT grows by one.
+ * return -1 if FS_OPEN_MAX_COUNT descriptors are open
+ */
+int alloc_fd(vDisk *disk)
+{
+    for (int s = 0; s < FD_SUMMARY_WORDS; ++s) {
+        if(!disk->freeFdChunk[s])
+            continue;
+        int chunk = s * MAP_WORD_BITS + __builtin_ctzll(disk->freeFdChunk[s]);
+        int fd = chunk * FD_CHUNK + __builtin_ctzll(disk->freeFd[chunk]);
+        disk->freeFd[chunk] &= disk->freeFd[chunk] - 1;
+        if(!disk->freeFd[chunk])
+            disk->freeFdChunk[s] &= ~((uint64_t)1 << (chunk % MAP_WORD_BITS));
+        ++disk->usedFd;
+        return fd;
+    }
+
+    if(disk->numFDTChunk == FD_CHUNKS)
         return -1;
+    fileDes_t chunk = malloc(FD_CHUNK * sizeof(fileDes));
+    if(!chunk)
+        die_perror("malloc");
+    for (int l = 0; l < FD_CHUNK; ++l){
+        //we use -1 indicates that entry is free
+        pthread_rwlock_init(&chunk[l].lock, NULL);
+        chunk[l].fileID = -1;
+        chunk[l].offset = 0;
+        chunk[l].curBlock = 0;
+        chunk[l].curIndex = FAT_EOC;
+        chunk[l].raNext = 0;
+        chunk[l].raEnd = 0;
+        chunk[l].raWindow = 0;
+        chunk[l].wbBuf = NULL;
+        chunk[l].wbStart = 0;
+        chunk[l].wbLen = 0;
+        chunk[l].aioPending = 0;
     }
+    int c = disk->numFDTChunk++;
+    __atomic_store_n(&disk->FDT[c], chunk, __ATOMIC_RELEASE);
+    disk->freeFd[c] = ~(uint64_t)0;
+    disk->freeFdChunk[c / MAP_WORD_BITS] |= (uint64_t)1 << (c % MAP_WORD_BITS);
+    return alloc_fd(disk);
+}
 
-    int fileID = get_file_ID(filename);
-    assert(fileID < FS_FILE_MAX_COUNT);
+/*
+ * give file descriptor @fd back, the caller holds fdtLock
+ */
+void free_fd(vDisk *disk, int fd)
+{
+    int chunk = fd / FD_CHUNK;
+    disk->freeFd[chunk] |= (uint64_t)1 << (fd % FD_CHUNK);
+    disk->freeFdChunk[chunk / MAP_WORD_BITS] |= (uint64_t)1 << (chunk % MAP_WORD_BITS);
+    --disk->usedFd;
+}
 
-    //get fd and check if this file is opened before
-    int fd;
-    for (fd = 0; fd < FS_OPEN_MAX_COUNT; ++fd) {
-        //get first available entry
-        if(disk.FDT[fd].fileID == -1)
-            break;
+/*
+ * open @filename, which is known to be valid
+ */
+int open_file(vDisk *disk, const char *filename)
+{
+    pthread_rwlock_rdlock(&disk->rootLock);
+    int fileID = get_file_ID(disk, filename);
+    if(fileID < 0){
+        pthread_rwlock_unlock(&disk->rootLock);
+        return -1;
     }
 
-    assert(disk.FDT[fd].offset == 0 && disk.FDT[fd].fileID == -1);
+    //get first available entry
+    pthread_mutex_lock(&disk->fdtLock);
+    int fd = alloc_fd(disk);
+    if(fd >= 0)
+        ++disk->openCount[fileID];
+    pthread_mutex_unlock(&disk->fdtLock);
+    pthread_rwlock_unlock(&disk->rootLock);
+    if(fd < 0)
+        return -1;
 
     //initialize file descriptor
-    disk.FDT[fd].fileID = fileID;
-
-    --disk.freeFd;
+    fileDes_t file = get_fd(disk, fd);
+    pthread_rwlock_wrlock(&file->lock);
+    assert(file->offset == 0 && file->fileID == -1);
+    file->fileID = fileID;
+    pthread_rwlock_unlock(&file->lock);
     return fd;
 }
 
+int fsi_open(vDisk *disk, const char *filename)
+{
+    if(!disk || check_filename(filename))
+        return -1;
+    return open_file(disk, filename);
+}
+
+int fsi_open_name(vDisk *disk, const char *filename, size_t len)
+{
+    if(!disk || !filename || !len || len >= FS_FILENAME_LEN)
+        return -1;
+
+    char name[FS_FILENAME_LEN];
+    memcpy(name, filename, len);
+    name[len] = '\0';
+    return open_file(disk, name);
+}
+
 /*
- * check if input fd is valid or not
+ * check if input fd is valid and lock it
+ * for the operation about to be performed,
+ * @shared if the offset and cursor are not used
  * return -1 if fd is invalid
- * return 0 if fd is valid
+ * return 0 if fd is valid, it must be released
+ *      with unlock_fd afterwards
  */
-int check_fd(int fd)
+int lock_fd(vDisk *disk, int fd, bool shared)
 {
-    if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || disk.FDT[fd].fileID == -1)
+    if(!disk || fd < 0 || fd >= FS_OPEN_MAX_COUNT
+        || !__atomic_load_n(&disk->FDT[fd / FD_CHUNK], __ATOMIC_ACQUIRE))
+        return -1;
+
+    fileDes_t file = get_fd(disk, fd);
+    if(shared)
+        pthread_rwlock_rdlock(&file->lock);
+    else
+        pthread_rwlock_wrlock(&file->lock);
+    if(file->fileID == -1){
+        pthread_rwlock_unlock(&file->lock);
         return -1;
+    }
     return 0;
 }
 
-int fs_close(int fd)
+void unlock_fd(vDisk *disk, int fd)
+{
+    pthread_rwlock_unlock(&get_fd(disk, fd)->lock);
+}
+
+int fsi_close(vDisk *disk, int fd)
 {
-    if(!disk.superBlock || check_fd(fd))
+    if(lock_fd(disk, fd, false))
         return -1;
 
-    disk.FDT[fd].fileID = -1;
-    disk.FDT[fd].offset = 0;
+    //block requests of asynchronous requests still use the
+    //fd until fs_aio_poll or fs_aio_wait collected them
+    fileDes_t file = get_fd(disk, fd);
+    pthread_mutex_lock(&disk->aioLock);
+    size_t aioPending = file->aioPending;
+    pthread_mutex_unlock(&disk->aioLock);
+    if(aioPending){
+        unlock_fd(disk, fd);
+        return -1;
+    }
 
-    ++disk.freeFd;
-    return 0;
+    int ret = flush_write_buffer(disk, file);
+    free(file->wbBuf);
+    file->wbBuf = NULL;
+    int fileID = file->fileID;
+    file->fileID = -1;
+    file->offset = 0;
+    file->curBlock = 0;
+    file->curIndex = FAT_EOC;
+    file->raNext = 0;
+    file->raEnd = 0;
+    file->raWindow = 0;
+    unlock_fd(disk, fd);
+
+    pthread_mutex_lock(&disk->fdtLock);
+    free_fd(disk, fd);
+    --disk->openCount[fileID];
+    pthread_mutex_unlock(&disk->fdtLock);
+
+    if((metaMode & FS_META_SYNC_ON_CLOSE) && commit_metadata(disk))
+        return -1;
+    return ret;
 }
 
-int fs_stat(int fd)
+int fsi_size(vDisk *disk, int fd, size_t *size)
 {
-	if(!disk.superBlock || check_fd(fd))
+	if(!size || lock_fd(disk, fd, false))
 	    return -1;
-	int fileID = disk.FDT[fd].fileID;
-    return disk.rootDir[fileID].size;
+    if(flush_write_buffer(disk, get_fd(disk, fd))){
+        unlock_fd(disk, fd);
+        return -1;
+    }
+	int fileID = get_fd(disk, fd)->fileID;
+    pthread_rwlock_rdlock(&disk->fileLock[fileID]);
+    *size = disk->rootDir[fileID].size;
+    pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    unlock_fd(disk, fd);
+    return 0;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fsi_stat(vDisk *disk, int fd)
 {
-    if(!disk.superBlock || check_fd(fd))
-        return -1;
-    //check if offset is out of bound
-    int fileID = disk.FDT[fd].fileID;
-    if(offset > disk.rootDir[fileID].size)
+    size_t size;
+    if(fsi_size(disk, fd, &size) || size > INT_MAX)
         return -1;
-    //set offset
-    disk.FDT[fd].offset = offset;
-    return 0;
+    return size;
 }
 
-/*
- * These flags are used to helps us manage the behavior of fs_read and fs_write.
- *
+int fsi_lseek(vDisk *disk, int fd, size_t offset)
+{
+    if(lock_fd(disk, fd, false))
+        return -1;
+    if(flush_write_buffer(disk, get_fd(disk, fd))){
+        unlock_fd(disk, fd);
+        return -1;
+    }
+    //check if offset is out of bound
+    int fileID = get_fd(disk, fd)->fileID;
+    pthread_rwlock_rdlock(&disk->fileLock[fileID]);
+    int ret = -1;
+    if(offset <= disk->rootDir[fileID].size){
+        //set offset
+        get_fd(disk, fd)->offset = offset;
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    unlock_fd(disk, fd);
+    return ret;
+}
+
+int fsi_set_write_buffer(vDisk *disk, int fd, int enable)
+{
+    if(lock_fd(disk, fd, false))
+        return -1;
+
+    fileDes_t file = get_fd(disk, fd);
+    int ret = 0;
+    if(enable && !file->wbBuf){
+        file->wbBuf = malloc(BLOCK_SIZE);
+        if(!file->wbBuf)
+            die_perror("malloc");
+    } else if(!enable && file->wbBuf){
+        ret = flush_write_buffer(disk, file);
+        free(file->wbBuf);
+        file->wbBuf = NULL;
+    }
+    unlock_fd(disk, fd);
+    return ret;
+}
+
+/*
+ * These flags are used to helps us manage the behavior of fs_read and fs_write.
+ *
  * BLOCK_END means offset of file is reaching the end of the buffered
  * block. Therefore, we need to read/write to a new block
  *
@@ -489,38 +1371,54 @@ typedef enum operation{READ, WRITE} OP;
 
 /*
  * return the index of block where
- * offset of @fd is located. We
- * guarantee that fd is valid
+ * offset of @file is located. We
+ * guarantee that file is valid
+ *
+ * The chain is walked from the cursor cached in @file,
+ * so sequential access only costs the hops between two
+ * calls. We restart from startIndex only if the offset
+ * moved backwards (fs_lseek) or the cursor is not set yet.
+ * Blocks of an open file are never freed, so the cursor
+ * can not go stale.
  */
-uint16_t get_offset_block(int fd)
+uint32_t get_offset_block(vDisk *disk, fileDes_t file)
 {
-    int fileID = disk.FDT[fd].fileID;
-    assert(disk.FDT[fd].offset >= 0 && disk.FDT[fd].offset <= disk.rootDir[fileID].size);
+    int fileID = file->fileID;
+    assert(file->offset >= 0 && file->offset <= disk->rootDir[fileID].size);
 
-    uint16_t blockIndex = disk.rootDir[fileID].startIndex;
-    size_t numBlock = disk.FDT[fd].offset / BLOCK_SIZE;
+    size_t numBlock = file->offset / BLOCK_SIZE;
+    size_t i = file->curBlock;
+    uint32_t blockIndex = file->curIndex;
 
-    for (size_t i = 0; i < numBlock; ++i) {
-        blockIndex = disk.arrFAT[blockIndex];
+    if(blockIndex == FAT_EOC || numBlock < i){
+        i = 0;
+        blockIndex = disk->rootDir[fileID].startIndex;
+    }
+
+    for (; i < numBlock; ++i) {
+        blockIndex = disk->arrFAT[blockIndex];
     }
     assert(blockIndex != FAT_EOC);
-    return disk.superBlock->dataStartIndex + blockIndex;
+
+    file->curBlock = numBlock;
+    file->curIndex = blockIndex;
+    return disk->dataStartIndex + blockIndex;
 }
 
 /*
  * This function is the key to our fs_write and fs_read!
  * return which end will come next
- * @fd: File descriptor
+ * @file: File descriptor
  * @count: Number of bytes needed to read
  */
-end_flag next_end(int fd, size_t count)
+end_flag next_end(vDisk *disk, fileDes_t file, size_t count)
 {
-    int fileID = disk.FDT[fd].fileID;
-    assert(disk.FDT[fd].offset >= 0 && disk.FDT[fd].offset <= disk.rootDir[fileID].size);
+    int fileID = file->fileID;
+    assert(file->offset >= 0 && file->offset <= disk->rootDir[fileID].size);
 
     //TODO: +1 or not +1? This is a problem
-    size_t byteToBlockEnd = BLOCK_SIZE - (disk.FDT[fd].offset) % BLOCK_SIZE;
-    size_t byteToFileEnd = disk.rootDir[fileID].size - disk.FDT[fd].offset;
+    size_t byteToBlockEnd = BLOCK_SIZE - (file->offset) % BLOCK_SIZE;
+    size_t byteToFileEnd = disk->rootDir[fileID].size - file->offset;
 
     if(count < byteToBlockEnd){
         if(count < byteToFileEnd)
@@ -536,17 +1434,17 @@ end_flag next_end(int fd, size_t count)
 /*
  * return cache offset given fd
  */
-size_t get_cache_offset(int fd)
+size_t get_cache_offset(vDisk *disk, fileDes_t file)
 {
-    int fileID = disk.FDT[fd].fileID;
-    assert(disk.FDT[fd].offset >= 0 && disk.FDT[fd].offset <= disk.rootDir[fileID].size);
+    int fileID = file->fileID;
+    assert(file->offset >= 0 && file->offset <= disk->rootDir[fileID].size);
 
-    size_t cache_offset = (disk.FDT[fd].offset) % BLOCK_SIZE;
+    size_t cache_offset = (file->offset) % BLOCK_SIZE;
     return cache_offset;
 }
 
 /*
- * @fd: File descriptor
+ * @file: File descriptor
  * @count: Number of bytes of data to be written
  * it will update the size of the file that fd
  * associated with.
@@ -555,54 +1453,217 @@ size_t get_cache_offset(int fd)
  *
  * Return: the size of the file
  */
-size_t update_file_size(int fd, size_t count)
+size_t update_file_size(vDisk *disk, fileDes_t file, size_t count)
 {
-    int fileID = disk.FDT[fd].fileID;
-    if(disk.FDT[fd].offset + count <= disk.rootDir[fileID].size)
-        return disk.rootDir[fileID].size;
-    return disk.FDT[fd].offset + count;
+    int fileID = file->fileID;
+    if(file->offset + count <= disk->rootDir[fileID].size)
+        return disk->rootDir[fileID].size;
+    return file->offset + count;
 }
 
 /*
- * @fd: File descriptor
- * @count: Number of blocks need to be allocate
+ * return the last block of file @fileID,
+ * FAT_EOC if the file has no block yet.
+ * The chain is only walked the first time,
+ * get_new_block keeps the tail up to date.
+ */
+uint32_t get_file_tail(vDisk *disk, int fileID)
+{
+    if(disk->tailOf[fileID] != TAIL_UNKNOWN)
+        return disk->tailOf[fileID];
+
+    uint32_t blockIndex = disk->rootDir[fileID].startIndex;
+    while(blockIndex != FAT_EOC && disk->arrFAT[blockIndex] != FAT_EOC)
+        blockIndex = disk->arrFAT[blockIndex];
+
+    disk->tailOf[fileID] = blockIndex;
+    return blockIndex;
+}
+
+/*
+ * return the first FAT entry at or after @from
+ * whose free bit equals @isFree, or numDataBlock
+ * if there is none. Whole words are skipped at once.
+ */
+size_t find_next_bit(vDisk *disk, size_t from, bool isFree)
+{
+    size_t numDataBlock = disk->numDataBlock;
+    if(from >= numDataBlock)
+        return numDataBlock;
+
+    size_t word = from / MAP_WORD_BITS;
+    uint64_t bits = isFree ? disk->freeMap[word] : ~disk->freeMap[word];
+    bits &= ~(uint64_t)0 << (from % MAP_WORD_BITS);
+
+    while(!bits){
+        if(++word >= MAP_WORDS(numDataBlock))
+            return numDataBlock;
+        bits = isFree ? disk->freeMap[word] : ~disk->freeMap[word];
+    }
+
+    size_t index = word * MAP_WORD_BITS + __builtin_ctzll(bits);
+    return index < numDataBlock ? index : numDataBlock;
+}
+
+/*
+ * return the first free FAT entry at or after
+ * disk->nextFree, wrapping around to the beginning
+ * of the FAT.
  *
- * Return: Number of blocks that are actually allocated
+ * Return: index of the free entry, 0 if the FAT is full
+ */
+uint32_t find_free_block(vDisk *disk)
+{
+    if(disk->freeFATEntries <= 0)
+        return 0;
+
+    size_t index = find_next_bit(disk, disk->nextFree, true);
+    if(index == disk->numDataBlock)
+        index = find_next_bit(disk, 1, true);
+    return index == disk->numDataBlock ? 0 : index;
+}
+
+/*
+ * find a run of free FAT entries for @count blocks.
+ * Best-fit: the smallest run that holds all @count
+ * blocks, or the largest run if none is big enough.
+ *
+ * Return: first entry of the run, 0 if the FAT is full.
+ * @runLength is set to the length of that run.
  */
-size_t get_new_block(int fd, size_t count)
+uint32_t find_free_extent(vDisk *disk, size_t count, size_t *runLength)
 {
-    int fileID = disk.FDT[fd].fileID;
-    uint16_t blockIndex = disk.rootDir[fileID].startIndex;
+    size_t numDataBlock = disk->numDataBlock;
+    size_t bestStart = 0, bestLength = 0;
 
-    //move to the end of the linked list
-    while(blockIndex != FAT_EOC && disk.arrFAT[blockIndex] != FAT_EOC)
-        blockIndex = disk.arrFAT[blockIndex];
+    size_t start = find_next_bit(disk, 1, true);
+    while(start < numDataBlock){
+        size_t end = find_next_bit(disk, start, false);
+        size_t length = end - start;
 
+        if(length == count){
+            bestStart = start;
+            bestLength = length;
+            break;
+        }
+        //take a run that fits over one that doesn't,
+        //then the tighter fit, or the longer one if nothing fits
+        if(!bestLength
+            || (length >= count && (bestLength < count || length < bestLength))
+            || (length < count && bestLength < count && length > bestLength))
+        {
+            bestStart = start;
+            bestLength = length;
+        }
+        start = find_next_bit(disk, end, true);
+    }
+
+    *runLength = bestLength;
+    return bestStart;
+}
+
+/*
+ * take free FAT entry @i and link it
+ * at the end of the chain of @fileID,
+ * @tail is the current last block
+ */
+void claim_block(vDisk *disk, int fileID, uint32_t *tail, uint32_t i)
+{
+    disk->freeMap[i / MAP_WORD_BITS] &= ~((uint64_t)1 << (i % MAP_WORD_BITS));
+    --disk->freeFATEntries;
+    disk->nextFree = (i + 1) % disk->numDataBlock;
+
+    if(*tail == FAT_EOC) {
+        pthread_mutex_lock(&disk->metaLock);
+        disk->rootDir[fileID].startIndex = i;
+        set_root_dirty(disk, fileID);
+        pthread_mutex_unlock(&disk->metaLock);
+    } else {
+        set_fat(disk, *tail, i);
+    }
+    *tail = i;
+    set_fat(disk, i, FAT_EOC);
+}
+
+/*
+ * allocation for FS_ALLOC_EXTENT mode.
+ * If the blocks right after the tail are free we keep
+ * growing the file in place, otherwise whole free runs
+ * are taken best-fit, so that the file stays contiguous
+ * whenever the disk allows it.
+ *
+ * Return: Number of blocks that are actually allocated
+ */
+size_t get_new_extent(vDisk *disk, int fileID, uint32_t *tail, size_t count)
+{
     size_t blockAllocated = 0;
-    //disk.arrFAT[0] is always FAT_EOC, so we check from the second element
-    for (int i = 1; i < disk.superBlock->numDataBlock; ++i) {
-        if(blockAllocated >= count)
+
+    //keep growing in place if the whole request fits there
+    if(*tail != FAT_EOC){
+        size_t next = *tail + 1;
+        if(find_next_bit(disk, next, false) - next >= count) {
+            while(blockAllocated < count) {
+                claim_block(disk, fileID, tail, next++);
+                ++blockAllocated;
+            }
+            return blockAllocated;
+        }
+    }
+
+    while(blockAllocated < count){
+        size_t runLength;
+        uint32_t i = find_free_extent(disk, count - blockAllocated, &runLength);
+        if(!i)
             break;
-        if(disk.arrFAT[i] != 0)
-            continue;
-        //disk.arrFAT[i] == 0 and blockAllocated < count
-        ++blockAllocated;
-        if(blockIndex == FAT_EOC){
-            blockIndex = i;
-            disk.rootDir[fileID].startIndex = i;
-            continue;
+        for (size_t j = 0; j < runLength && blockAllocated < count; ++j) {
+            claim_block(disk, fileID, tail, i + j);
+            ++blockAllocated;
         }
-        disk.arrFAT[blockIndex] = i;
-        blockIndex = i;
     }
-    disk.arrFAT[blockIndex] = FAT_EOC;
-    disk.freeFATEntries -= blockAllocated;
     return blockAllocated;
 }
 
+/*
+ * @file: File descriptor
+ * @count: Number of blocks need to be allocate
+ *
+ * Blocks are taken from the free bitmap, next-fit by
+ * default or whole extents in FS_ALLOC_EXTENT mode,
+ * and linked after the cached tail of the file.
+ *
+ * Return: Number of blocks that are actually allocated
+ */
+size_t get_new_block(vDisk *disk, fileDes_t file, size_t count)
+{
+    int fileID = file->fileID;
+    pthread_mutex_lock(&disk->fatLock);
+    uint32_t blockIndex = get_file_tail(disk, fileID);
+
+    size_t blockAllocated = 0;
+    if(allocMode == FS_ALLOC_EXTENT) {
+        blockAllocated = get_new_extent(disk, fileID, &blockIndex, count);
+    } else {
+        while(blockAllocated < count){
+            uint32_t i = find_free_block(disk);
+            //disk->arrFAT[0] is always FAT_EOC, so 0 means no free entry
+            if(!i)
+                break;
+            claim_block(disk, fileID, &blockIndex, i);
+            ++blockAllocated;
+        }
+    }
+    disk->tailOf[fileID] = blockIndex;
+    pthread_mutex_unlock(&disk->fatLock);
+    return blockAllocated;
+}
+
+//block for partial reads and writes, one per thread so
+//that the read/write path does not touch the heap
+static __thread char bounce[BLOCK_SIZE] __attribute__((aligned(CACHE_LINE)));
+
 /*
  * operate = either write or read
- * @fd: File descriptor
+ * @file: File descriptor
  * @buf: Data buffer to operate
  * @buf_offset: Which data we want to operate next
  * @count: Total number of data we want to operate
@@ -618,30 +1679,31 @@ size_t get_new_block(int fd, size_t count)
  * This function will not change anything to outside variable,
  * except writing to disk.
  *
- * Return: Number of bytes that are actually operated
+ * Return: Number of bytes that are actually operated,
+ * 0 if the block could not be read or written
  */
-size_t mismatch_write_read(int fd, void *buf, size_t buf_offset, size_t count, uint16_t blockIndex,
+size_t mismatch_write_read(vDisk *disk, fileDes_t file, void *buf, size_t buf_offset, size_t count, uint32_t blockIndex,
                       size_t cache_offset, end_flag flag, OP operation)
 {
     if(count == buf_offset)
         return 0;
 
-    void *cache = malloc(BLOCK_SIZE);
-    if (!cache)
-        die_perror("malloc");
-    block_read(blockIndex, cache);
-
     //Calculate how many bytes we need to operate
     size_t opByte;
-    int fileID = disk.FDT[fd].fileID;
+    int fileID = file->fileID;
     if(flag == BLOCK_END) {
         opByte = BLOCK_SIZE - cache_offset;
     } else if (flag == FILE_END){
-        opByte = disk.rootDir[fileID].size - disk.FDT[fd].offset;
+        opByte = disk->rootDir[fileID].size - file->offset;
     } else {
-        opByte = count;
+        opByte = count - buf_offset;
     }
 
+    //a write of the whole block does not need its old content
+    void *cache = bounce;
+    if((operation == READ || opByte < BLOCK_SIZE) && cache_read(disk->cache, blockIndex, cache))
+        return 0;
+
     //based on operation, we decide what's dest and what's src
     void *dest;
     void *src;
@@ -656,108 +1718,924 @@ size_t mismatch_write_read(int fd, void *buf, size_t buf_offset, size_t count, u
     memcpy(dest, src, opByte);
 
     //if operation is write, we need to write back to disk
+    if(operation == WRITE && cache_write(disk->cache, blockIndex, cache))
+        return 0;
+
+    return opByte;
+}
+
+/*
+ * queue whole blocks for asynchronous request @aio.
+ * Blocks that are consecutive both on disk and in the
+ * buffer go out as a single block request. Reads are
+ * served from the cache when the block is there, cached
+ * copies of written blocks are refreshed.
+ */
+void queue_blocks(vDisk *disk, int aio, const size_t *blocks, void *const *bufs, size_t count, OP operation)
+{
+    void *tag = (void *)(intptr_t)aio;
+    size_t i = 0;
+
+    //before queueing, so that a stale dirty copy can
+    //not be evicted over the blocks being written
     if(operation == WRITE)
-        block_write(blockIndex, cache);
+        cache_refresh(disk->cache, blocks, bufs, count);
+
+    while(i < count){
+        if(operation == READ && !cache_peek(disk->cache, blocks[i], bufs[i])){
+            ++i;
+            continue;
+        }
 
-    free(cache);
+        //extend the run, a read stops at the next cached block
+        size_t n = 1;
+        bool cached = false;
+        while(i + n < count && blocks[i + n] == blocks[i] + n
+              && bufs[i + n] == (char *)bufs[i] + n * BLOCK_SIZE)
+        {
+            if(operation == READ && !cache_peek(disk->cache, blocks[i + n], bufs[i + n])){
+                cached = true;
+                break;
+            }
+            ++n;
+        }
 
-    return opByte;
+        //counted first, another thread may reap it right away
+        pthread_mutex_lock(&disk->aioLock);
+        ++disk->aio[aio].pendingIO;
+        count_block_request(disk, &disk->aio[aio], 1);
+        pthread_mutex_unlock(&disk->aioLock);
+
+        int ret;
+        if(operation == WRITE)
+            ret = bdisk_queue_write(disk->blockDisk, blocks[i], n, bufs[i], tag);
+        else
+            ret = bdisk_queue_read(disk->blockDisk, blocks[i], n, bufs[i], tag);
+        if(ret){
+            pthread_mutex_lock(&disk->aioLock);
+            disk->aio[aio].result = -1;
+            --disk->aio[aio].pendingIO;
+            count_block_request(disk, &disk->aio[aio], -1);
+            pthread_mutex_unlock(&disk->aioLock);
+        }
+
+        i += n + cached;
+    }
 }
 
 /*
- * @fd: File descriptor
+ * transfer whole blocks starting at the offset of @file,
+ * which must be aligned to the beginning of a block.
+ * All blocks that are fully covered by both the request
+ * and the file (at most FS_IO_BATCH) are collected from
+ * the FAT chain and handed to the cache in one vectored
+ * call, so consecutive blocks become a single disk I/O.
+ *
+ * If @aio is not NO_AIO, the blocks are queued for that
+ * asynchronous request instead.
+ *
+ * The cursor of @file is left on the last block operated.
+ *
+ * Return: Number of bytes that are actually operated,
+ * 0 if the blocks could not be read or written
+ */
+size_t full_write_read(vDisk *disk, fileDes_t file, void *buf, size_t buf_offset, size_t count, OP operation, int aio)
+{
+    int fileID = file->fileID;
+    size_t byteLeft = count - buf_offset;
+    size_t byteToFileEnd = disk->rootDir[fileID].size - file->offset;
+    size_t numBlock = (byteLeft < byteToFileEnd ? byteLeft : byteToFileEnd) / BLOCK_SIZE;
+    if(numBlock > FS_IO_BATCH)
+        numBlock = FS_IO_BATCH;
+    assert(numBlock > 0);
+
+    size_t blocks[FS_IO_BATCH];
+    void *bufs[FS_IO_BATCH];
+
+    blocks[0] = get_offset_block(disk, file);
+    bufs[0] = (char *)buf + buf_offset;
+    uint32_t blockIndex = file->curIndex;
+    for (size_t i = 1; i < numBlock; ++i) {
+        blockIndex = disk->arrFAT[blockIndex];
+        blocks[i] = disk->dataStartIndex + blockIndex;
+        bufs[i] = (char *)buf + buf_offset + i * BLOCK_SIZE;
+    }
+
+    if(aio != NO_AIO)
+        queue_blocks(disk, aio, blocks, bufs, numBlock, operation);
+    else if(operation == WRITE && cache_writev(disk->cache, blocks, bufs, numBlock))
+        return 0;
+    else if(operation == READ && cache_readv(disk->cache, blocks, bufs, numBlock))
+        return 0;
+
+    file->curBlock += numBlock - 1;
+    file->curIndex = blockIndex;
+    return numBlock * BLOCK_SIZE;
+}
+
+/*
+ * @file: File descriptor
  * @buf: Data buffer
  * @count: Number of bytes
  * @operation: Which operation need to be performed
+ * @aio: Asynchronous request whole blocks are queued
+ * for, NO_AIO to transfer them right away
  *
  * this function is meant to combine the common part
  * of fs_read and fs_write, so that it will be easier
  * for us to debug or add new function.
  *
- * Return: the actual byte that is being read or written
+ * Return: the actual byte that is being read or written,
+ * which stops short at the first block that failed
  */
-size_t disk_write_read(int fd, void *buf, size_t count, OP operation)
+size_t disk_write_read(vDisk *disk, fileDes_t file, void *buf, size_t count, OP operation, int aio)
 {
     //these are set up work
     size_t buf_offset = 0;
-    size_t old_val_offset = disk.FDT[fd].offset;
-    size_t cache_offset = get_cache_offset(fd);
+    size_t old_val_offset = file->offset;
+    size_t cache_offset = get_cache_offset(disk, file);
     size_t opByte = 0;
-    uint16_t blockIndex = 0;
-    end_flag flag = next_end(fd, count);
+    uint32_t blockIndex = 0;
+    end_flag flag = next_end(disk, file, count);
+
+    //blocks accessed right away must not race with asynchronous
+    //writes of the file still in flight, whole blocks of another
+    //asynchronous write are simply queued after them
+    bool partial = cache_offset || count % BLOCK_SIZE;
+    if((aio == NO_AIO || (operation == WRITE && partial)) && wait_file_writes(disk, file->fileID))
+        return 0;
 
     while(flag == BLOCK_END)
     {
-        blockIndex = get_offset_block(fd);
         //read next block
         if(cache_offset > 0){
-            opByte = mismatch_write_read(fd, buf, buf_offset, count, blockIndex, cache_offset, flag, operation);
+            blockIndex = get_offset_block(disk, file);
+            opByte = mismatch_write_read(disk, file, buf, buf_offset, count, blockIndex, cache_offset, flag, operation);
         } else {
-            if(operation == WRITE)
-                assert(!block_write(blockIndex, (char *)buf + buf_offset));
-            else
-                assert(!block_read(blockIndex, (char *)buf + buf_offset));
-            opByte = BLOCK_SIZE;
+            opByte = full_write_read(disk, file, buf, buf_offset, count, operation, aio);
         }
+        if(!opByte)
+            return file->offset - old_val_offset;
 
         //update all variable accordingly
         buf_offset += opByte;
-        disk.FDT[fd].offset += opByte;
-        cache_offset = get_cache_offset(fd);
-        flag = next_end(fd, count - buf_offset);
+        file->offset += opByte;
+        cache_offset = get_cache_offset(disk, file);
+        flag = next_end(disk, file, count - buf_offset);
     }
 
-    blockIndex = get_offset_block(fd);
-    opByte = mismatch_write_read(fd, buf, buf_offset, count, blockIndex, cache_offset, flag, operation);
-    disk.FDT[fd].offset += opByte;
+    //nothing left before the end of the file, the offset may
+    //sit right after the last block of the chain
+    if(buf_offset == count || file->offset == disk->rootDir[file->fileID].size)
+        return file->offset - old_val_offset;
+
+    blockIndex = get_offset_block(disk, file);
+    opByte = mismatch_write_read(disk, file, buf, buf_offset, count, blockIndex, cache_offset, flag, operation);
+    file->offset += opByte;
 
-    return disk.FDT[fd].offset - old_val_offset;
+    return file->offset - old_val_offset;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+/*
+ * common part of fs_write and fs_aio_write:
+ * allocate the blocks the write needs, write
+ * the data and update metadata
+ * Return: the number of bytes written, or -1
+ * if the metadata could not be committed
+ */
+int write_file(vDisk *disk, fileDes_t file, void *buf, size_t count, int aio)
 {
-    if(!disk.superBlock || check_fd(fd))
-        return -1;
-    if(!count)
-        return 0;
-
-    int fileID = disk.FDT[fd].fileID;
+    int fileID = file->fileID;
 
     //First, we want to check if we need to allocate new blocks.
     //If we need, we allocate them beforehand
-    size_t old_val_size = disk.rootDir[fileID].size;
-    size_t old_block_num = BLOCK_NUM(disk.rootDir[fileID].size);
-    disk.rootDir[fileID].size = update_file_size(fd, count);
-    size_t new_block_num = BLOCK_NUM(disk.rootDir[fileID].size);
+    size_t old_val_size = disk->rootDir[fileID].size;
+    size_t old_block_num = BLOCK_NUM(old_val_size);
+    size_t new_size = update_file_size(disk, file, count);
+    size_t new_block_num = BLOCK_NUM(new_size);
     size_t get_block_num = 0;
 
     //allocate new blocks for @fileID
     if(new_block_num > old_block_num) {
-        get_block_num = get_new_block(fd, new_block_num - old_block_num);
+        get_block_num = get_new_block(disk, file, new_block_num - old_block_num);
         assert(get_block_num <= new_block_num - old_block_num);
         if (get_block_num < new_block_num - old_block_num)
-            disk.rootDir[fileID].size = (old_block_num + get_block_num) * BLOCK_SIZE;
+            new_size = (old_block_num + get_block_num) * BLOCK_SIZE;
     }
 
-    size_t writeByte = disk_write_read(fd, buf, count, WRITE);
+    if(old_val_size != new_size){
+        pthread_mutex_lock(&disk->metaLock);
+        disk->rootDir[fileID].size = new_size;
+        set_root_dirty(disk, fileID);
+        pthread_mutex_unlock(&disk->metaLock);
+    }
+
+    size_t writeByte = disk_write_read(disk, file, buf, count, WRITE, aio);
 
     //write dirty metadata back into the disk
-    if(old_val_size != disk.rootDir[fileID].size)
-        assert(!write_back(disk.rootDir, disk.superBlock->rootIndex, 1));
-    if(get_block_num)
-        assert(!write_back(disk.arrFAT, 1, disk.superBlock->numFATBlock));
+    if((old_val_size != new_size || get_block_num) && metadata_changed(disk))
+        return -1;
 
     return writeByte;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/*
+ * write the bytes buffered on @file, the caller
+ * holds the fd lock exclusively. The offset of
+ * @file ends right after the bytes that made it.
+ * return -1 if the disk had no room for all of them
+ */
+int flush_write_buffer(vDisk *disk, fileDes_t file)
+{
+    if(!file->wbLen)
+        return 0;
+
+    size_t len = file->wbLen;
+    file->wbLen = 0;
+    file->offset = file->wbStart;
+    int fileID = file->fileID;
+    pthread_rwlock_wrlock(&disk->fileLock[fileID]);
+    int writeByte = write_file(disk, file, file->wbBuf, len, NO_AIO);
+    pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    return writeByte == (int)len ? 0 : -1;
+}
+
+/*
+ * fs_write of less than a block on an fd with a write
+ * buffer: the bytes are appended to the buffer, which
+ * is written once it reaches the end of its block, so
+ * that small sequential writes become whole blocks.
+ * Return: the number of bytes written, or -1
+ */
+int buffer_write(vDisk *disk, fileDes_t file, const char *buf, size_t count)
+{
+    size_t old_val_offset = file->offset;
+    size_t done = 0;
+    while(done < count){
+        if(!file->wbLen)
+            file->wbStart = file->offset;
+        size_t room = BLOCK_SIZE - file->wbStart % BLOCK_SIZE - file->wbLen;
+        size_t opByte = count - done < room ? count - done : room;
+        memcpy(file->wbBuf + file->wbLen, buf + done, opByte);
+        file->wbLen += opByte;
+        file->offset += opByte;
+        done += opByte;
+
+        //when the disk is full, the offset falls back
+        //behind the bytes that could not be written,
+        //-1 if bytes of earlier calls were lost
+        if(opByte == room && flush_write_buffer(disk, file))
+            return file->offset >= old_val_offset ? (int)(file->offset - old_val_offset) : -1;
+    }
+    return count;
+}
+
+int fsi_write(vDisk *disk, int fd, void *buf, size_t count)
+{
+    if(lock_fd(disk, fd, false))
+        return -1;
+    if(count > MAX_TRANSFER)
+        count = MAX_TRANSFER;
+    if(!count){
+        unlock_fd(disk, fd);
+        return 0;
+    }
+
+    fileDes_t file = get_fd(disk, fd);
+    if(file->wbBuf && count < BLOCK_SIZE){
+        int writeByte = buffer_write(disk, file, buf, count);
+        unlock_fd(disk, fd);
+        return writeByte;
+    }
+    if(flush_write_buffer(disk, file)){
+        unlock_fd(disk, fd);
+        return -1;
+    }
+
+    int fileID = get_fd(disk, fd)->fileID;
+    pthread_rwlock_wrlock(&disk->fileLock[fileID]);
+    int writeByte = write_file(disk, get_fd(disk, fd), buf, count, NO_AIO);
+    pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    unlock_fd(disk, fd);
+
+    return writeByte;
+}
+
+/*
+ * read-ahead after fs_read transferred @count bytes
+ * from @offset, the caller holds the file lock.
+ *
+ * A read that starts in or right after the last block
+ * the previous one touched is sequential, each new
+ * block it reaches doubles the window. Any other read
+ * collapses it. Once less than half of the window is
+ * left prefetched, the blocks up to a full window past
+ * the read are brought into the buffer cache with one
+ * vectored disk read, so a stream of small reads does
+ * not pay one disk access per block.
+ */
+void read_ahead(vDisk *disk, fileDes_t file, size_t offset, size_t count)
+{
+    size_t maxWindow = cache_capacity(disk->cache) / 4;
+    if(maxWindow > RA_MAX_BLOCKS)
+        maxWindow = RA_MAX_BLOCKS;
+    if(!count || maxWindow < RA_MIN_BLOCKS)
+        return;
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t last = (offset + count - 1) / BLOCK_SIZE;
+    if(first != file->raNext && first + 1 != file->raNext){
+        file->raNext = last + 1;
+        file->raEnd = 0;
+        file->raWindow = 0;
+        return;
+    }
+    if(last >= file->raNext)
+        file->raWindow = file->raWindow ? file->raWindow * 2 : RA_MIN_BLOCKS;
+    if(file->raWindow > maxWindow)
+        file->raWindow = maxWindow;
+    file->raNext = last + 1;
+
+    size_t from = file->raEnd > last + 1 ? file->raEnd : last + 1;
+    size_t to = last + 1 + file->raWindow;
+    size_t fileBlock = BLOCK_NUM(disk->rootDir[file->fileID].size);
+    if(to > fileBlock)
+        to = fileBlock;
+    if(from >= to || from - (last + 1) > file->raWindow / 2)
+        return;
+
+    //the read left the cursor on its last block
+    assert(file->curIndex != FAT_EOC && file->curBlock <= from);
+    uint32_t blockIndex = file->curIndex;
+    for (size_t i = file->curBlock; i < from; ++i)
+        blockIndex = disk->arrFAT[blockIndex];
+
+    size_t blocks[RA_MAX_BLOCKS];
+    size_t n = 0;
+    for (size_t i = from; i < to; ++i) {
+        blocks[n++] = disk->dataStartIndex + blockIndex;
+        if(i + 1 < to)
+            blockIndex = disk->arrFAT[blockIndex];
+    }
+    //a failed prefetch is not an error, the read will retry
+    if(!cache_prefetch(disk->cache, blocks, n))
+        file->raEnd = to;
+}
+
+int fsi_read(vDisk *disk, int fd, void *buf, size_t count)
 {
-	if(!disk.superBlock || check_fd(fd))
+	if(lock_fd(disk, fd, false))
 	    return -1;
-    if(!count)
+    if(flush_write_buffer(disk, get_fd(disk, fd))){
+        unlock_fd(disk, fd);
+        return -1;
+    }
+    if(count > MAX_TRANSFER)
+        count = MAX_TRANSFER;
+    if(!count){
+        unlock_fd(disk, fd);
         return 0;
+    }
 
-    size_t readByte = disk_write_read(fd, buf, count, READ);
+    //readers of a file share its lock
+    int fileID = get_fd(disk, fd)->fileID;
+    pthread_rwlock_rdlock(&disk->fileLock[fileID]);
+    size_t offset = get_fd(disk, fd)->offset;
+    size_t readByte = disk_write_read(disk, get_fd(disk, fd), buf, count, READ, NO_AIO);
+    read_ahead(disk, get_fd(disk, fd), offset, readByte);
+    pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    unlock_fd(disk, fd);
 
     return readByte;
-}
\ No newline at end of file
+}
+
+/*
+ * common part of fs_pread and fs_pwrite: the operation
+ * runs on a private copy of the descriptor, so that
+ * its offset and cursor are left untouched and several
+ * of them can run on the same fd at once
+ */
+int positional_write_read(vDisk *disk, int fd, void *buf, size_t count, size_t offset, OP operation)
+{
+    if(lock_fd(disk, fd, true))
+        return -1;
+    //bytes buffered on @fd go first, which needs the fd for ourselves
+    if(get_fd(disk, fd)->wbLen){
+        unlock_fd(disk, fd);
+        if(lock_fd(disk, fd, false))
+            return -1;
+        int flushed = flush_write_buffer(disk, get_fd(disk, fd));
+        unlock_fd(disk, fd);
+        if(flushed || lock_fd(disk, fd, true))
+            return -1;
+    }
+    if(count > MAX_TRANSFER)
+        count = MAX_TRANSFER;
+
+    int fileID = get_fd(disk, fd)->fileID;
+    if(operation == WRITE)
+        pthread_rwlock_wrlock(&disk->fileLock[fileID]);
+    else
+        pthread_rwlock_rdlock(&disk->fileLock[fileID]);
+
+    //there are no holes, we can not start past the end
+    int ret = -1;
+    if(offset <= disk->rootDir[fileID].size){
+        fileDes file = {.fileID = fileID, .offset = offset,
+                        .curBlock = 0, .curIndex = FAT_EOC};
+        //start from the cursor of @fd if it is not past @offset
+        if(get_fd(disk, fd)->curIndex != FAT_EOC && get_fd(disk, fd)->curBlock <= offset / BLOCK_SIZE){
+            file.curBlock = get_fd(disk, fd)->curBlock;
+            file.curIndex = get_fd(disk, fd)->curIndex;
+        }
+
+        if(!count)
+            ret = 0;
+        else if(operation == WRITE)
+            ret = write_file(disk, &file, buf, count, NO_AIO);
+        else
+            ret = disk_write_read(disk, &file, buf, count, READ, NO_AIO);
+    }
+
+    pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    unlock_fd(disk, fd);
+    return ret;
+}
+
+int fsi_pwrite(vDisk *disk, int fd, void *buf, size_t count, size_t offset)
+{
+    return positional_write_read(disk, fd, buf, count, offset, WRITE);
+}
+
+int fsi_pread(vDisk *disk, int fd, void *buf, size_t count, size_t offset)
+{
+    return positional_write_read(disk, fd, buf, count, offset, READ);
+}
+
+int fsi_read_view(vDisk *disk, int fd, size_t count, struct fs_span *spans, size_t nspans)
+{
+    if(!spans || lock_fd(disk, fd, false))
+        return -1;
+    if(flush_write_buffer(disk, get_fd(disk, fd))
+        || !bdisk_map(disk->blockDisk, disk->dataStartIndex)){
+        unlock_fd(disk, fd);
+        return -1;
+    }
+
+    int fileID = get_fd(disk, fd)->fileID;
+    pthread_rwlock_rdlock(&disk->fileLock[fileID]);
+    if(wait_file_writes(disk, fileID)){
+        pthread_rwlock_unlock(&disk->fileLock[fileID]);
+        unlock_fd(disk, fd);
+        return -1;
+    }
+    size_t byteToFileEnd = disk->rootDir[fileID].size - get_fd(disk, fd)->offset;
+    size_t byteLeft = count < byteToFileEnd ? count : byteToFileEnd;
+    size_t numSpan = 0;
+    size_t oldOffset = get_fd(disk, fd)->offset;
+    bool failed = false;
+
+    while(byteLeft && numSpan < nspans){
+        size_t blockIndex = get_offset_block(disk, get_fd(disk, fd));
+        size_t cache_offset = get_cache_offset(disk, get_fd(disk, fd));
+        uint32_t fatIndex = get_fd(disk, fd)->curIndex;
+        size_t runBlock = 1;
+        size_t len = BLOCK_SIZE - cache_offset;
+
+        //newer data may still sit in the cache
+        if(cache_writeback(disk->cache, blockIndex)){
+            failed = true;
+            break;
+        }
+        //grow the span while the chain stays contiguous on disk
+        while(len < byteLeft && disk->arrFAT[fatIndex] == fatIndex + 1){
+            if(cache_writeback(disk->cache, disk->dataStartIndex + fatIndex + 1)){
+                failed = true;
+                break;
+            }
+            ++fatIndex;
+            ++runBlock;
+            len += BLOCK_SIZE;
+        }
+        if(failed)
+            break;
+        if(len > byteLeft)
+            len = byteLeft;
+
+        spans[numSpan].data = (char *)bdisk_map(disk->blockDisk, blockIndex) + cache_offset;
+        spans[numSpan].len = len;
+        ++numSpan;
+
+        get_fd(disk, fd)->curBlock += runBlock - 1;
+        get_fd(disk, fd)->curIndex = fatIndex;
+        get_fd(disk, fd)->offset += len;
+        byteLeft -= len;
+    }
+
+    //the mapping may be stale, give back the spans taken so far
+    if(failed){
+        get_fd(disk, fd)->offset = oldOffset;
+        get_fd(disk, fd)->curBlock = 0;
+        get_fd(disk, fd)->curIndex = FAT_EOC;
+        pthread_rwlock_unlock(&disk->fileLock[fileID]);
+        unlock_fd(disk, fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&disk->fdtLock);
+    disk->views += numSpan;
+    pthread_mutex_unlock(&disk->fdtLock);
+    pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    unlock_fd(disk, fd);
+    return numSpan;
+}
+
+int fsi_release_view(vDisk *disk, struct fs_span *spans, size_t nspans)
+{
+    if(!disk || (nspans && !spans))
+        return -1;
+
+    pthread_mutex_lock(&disk->fdtLock);
+    if(nspans > disk->views){
+        pthread_mutex_unlock(&disk->fdtLock);
+        return -1;
+    }
+    disk->views -= nspans;
+    pthread_mutex_unlock(&disk->fdtLock);
+
+    for (size_t i = 0; i < nspans; ++i) {
+        spans[i].data = NULL;
+        spans[i].len = 0;
+    }
+    return 0;
+}
+
+/*
+ * get a free asynchronous request handle for
+ * @operation on @fd, the table grows when all
+ * of them are used. The submission itself counts
+ * as a pending I/O until submit_aio is done with it.
+ */
+int get_aio_handle(vDisk *disk, int fd, OP operation, fs_aio_cb callback, void *arg)
+{
+    pthread_mutex_lock(&disk->aioLock);
+    if(disk->aioFree == NO_AIO){
+        int cap = disk->aioCap ? 2 * disk->aioCap : AIO_REAP_BATCH;
+        aioReq *aio = realloc(disk->aio, cap * sizeof(aioReq));
+        if(!aio)
+            die_perror("realloc");
+        for (int i = disk->aioCap; i < cap; ++i) {
+            aio[i].used = false;
+            aio[i].nextFree = i + 1 < cap ? i + 1 : NO_AIO;
+        }
+        disk->aio = aio;
+        disk->aioFree = disk->aioCap;
+        disk->aioCap = cap;
+    }
+
+    int handle = disk->aioFree;
+    aioReq *req = &disk->aio[handle];
+    disk->aioFree = req->nextFree;
+    ++disk->aioUsed;
+
+    req->used = true;
+    req->done = false;
+    req->claimed = false;
+    req->fd = fd;
+    req->fileID = get_fd(disk, fd)->fileID;
+    req->write = operation == WRITE;
+    req->result = 0;
+    req->pendingIO = 1;
+    req->callback = callback;
+    req->arg = arg;
+    pthread_mutex_unlock(&disk->aioLock);
+    return handle;
+}
+
+/*
+ * called with aioLock held
+ */
+void put_aio_handle(vDisk *disk, int handle)
+{
+    disk->aio[handle].used = false;
+    disk->aio[handle].nextFree = disk->aioFree;
+    disk->aioFree = handle;
+    --disk->aioUsed;
+}
+
+/*
+ * add @delta to the block requests of @req in flight
+ * on its fd and file, called with aioLock held
+ */
+void count_block_request(vDisk *disk, aioReq *req, int delta)
+{
+    get_fd(disk, req->fd)->aioPending += delta;
+    if(req->write)
+        __atomic_add_fetch(&disk->aioWrites[req->fileID], delta, __ATOMIC_RELEASE);
+}
+
+/*
+ * collect completed block requests and mark the fs
+ * requests they finish, called with aioLock held.
+ * If @wait is set we block until at least one of
+ * them completed. Only one thread waits in the block
+ * layer, the others sleep until it is back and then
+ * check their requests again.
+ *
+ * Return: number of block requests collected, -1 on failure
+ */
+int reap_aio(vDisk *disk, bool wait)
+{
+    if(disk->aioReaping){
+        if(wait)
+            pthread_cond_wait(&disk->aioReaped, &disk->aioLock);
+        return 0;
+    }
+
+    struct block_completion done[AIO_REAP_BATCH];
+    disk->aioReaping = true;
+    pthread_mutex_unlock(&disk->aioLock);
+    int n = bdisk_complete(disk->blockDisk, done, AIO_REAP_BATCH, wait);
+    pthread_mutex_lock(&disk->aioLock);
+    disk->aioReaping = false;
+
+    for (int i = 0; i < n; ++i) {
+        aioReq *req = &disk->aio[(intptr_t)done[i].tag];
+        count_block_request(disk, req, -1);
+        if(done[i].result)
+            req->result = -1;
+        if(--req->pendingIO == 0)
+            req->done = true;
+    }
+    pthread_cond_broadcast(&disk->aioReaped);
+    return n;
+}
+
+/*
+ * wait until the block writes of asynchronous requests
+ * on @fileID landed, before blocks of the file are
+ * accessed right away. Completions of other requests
+ * are collected meanwhile, fs_aio_poll or fs_aio_wait
+ * finish them as usual.
+ * Return: -1 if completions could not be collected
+ */
+int wait_file_writes(vDisk *disk, int fileID)
+{
+    if(!__atomic_load_n(&disk->aioWrites[fileID], __ATOMIC_ACQUIRE))
+        return 0;
+
+    int ret = 0;
+    pthread_mutex_lock(&disk->aioLock);
+    while(!ret && disk->aioWrites[fileID])
+        ret = reap_aio(disk, true) < 0 ? -1 : 0;
+    pthread_mutex_unlock(&disk->aioLock);
+    return ret;
+}
+
+/*
+ * common part of fs_aio_read and fs_aio_write: everything
+ * but whole data blocks is done right away, whole blocks
+ * are queued on the block layer and sent together
+ */
+int submit_aio(vDisk *disk, int fd, void *buf, size_t count, OP operation, fs_aio_cb callback, void *arg)
+{
+    if(lock_fd(disk, fd, false))
+        return -1;
+    if(flush_write_buffer(disk, get_fd(disk, fd))){
+        unlock_fd(disk, fd);
+        return -1;
+    }
+    if(count > MAX_TRANSFER)
+        count = MAX_TRANSFER;
+
+    int handle = get_aio_handle(disk, fd, operation, callback, arg);
+    int fileID = get_fd(disk, fd)->fileID;
+    int byte = 0;
+    if(count && operation == WRITE){
+        pthread_rwlock_wrlock(&disk->fileLock[fileID]);
+        byte = write_file(disk, get_fd(disk, fd), buf, count, handle);
+        pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    } else if(count) {
+        pthread_rwlock_rdlock(&disk->fileLock[fileID]);
+        byte = disk_write_read(disk, get_fd(disk, fd), buf, count, READ, handle);
+        pthread_rwlock_unlock(&disk->fileLock[fileID]);
+    }
+    unlock_fd(disk, fd);
+
+    pthread_mutex_lock(&disk->aioLock);
+    if(!disk->aio[handle].result)
+        disk->aio[handle].result = byte;
+    if(--disk->aio[handle].pendingIO == 0)
+        disk->aio[handle].done = true;
+    pthread_mutex_unlock(&disk->aioLock);
+    bdisk_submit(disk->blockDisk);
+    return handle;
+}
+
+int fsi_aio_write(vDisk *disk, int fd, void *buf, size_t count, fs_aio_cb callback, void *arg)
+{
+    return submit_aio(disk, fd, buf, count, WRITE, callback, arg);
+}
+
+int fsi_aio_read(vDisk *disk, int fd, void *buf, size_t count, fs_aio_cb callback, void *arg)
+{
+    return submit_aio(disk, fd, buf, count, READ, callback, arg);
+}
+
+int fsi_aio_poll(vDisk *disk)
+{
+    if(!disk)
+        return -1;
+
+    pthread_mutex_lock(&disk->aioLock);
+    int ret;
+    do {
+        ret = reap_aio(disk, false);
+        if(ret < 0){
+            pthread_mutex_unlock(&disk->aioLock);
+            return -1;
+        }
+    } while(ret == AIO_REAP_BATCH);
+
+    //callbacks may submit new requests and grow the table,
+    //so we only hold indexes across them, and no lock
+    int called = 0;
+    for (int i = 0; i < disk->aioCap; ++i) {
+        if(!disk->aio[i].used || !disk->aio[i].done || disk->aio[i].claimed
+            || !disk->aio[i].callback)
+            continue;
+        fs_aio_cb callback = disk->aio[i].callback;
+        void *arg = disk->aio[i].arg;
+        int result = disk->aio[i].result;
+        put_aio_handle(disk, i);
+        pthread_mutex_unlock(&disk->aioLock);
+        callback(i, result, arg);
+        pthread_mutex_lock(&disk->aioLock);
+        ++called;
+    }
+    pthread_mutex_unlock(&disk->aioLock);
+    return called;
+}
+
+int fsi_aio_wait(vDisk *disk, int handle)
+{
+    if(!disk)
+        return -1;
+
+    pthread_mutex_lock(&disk->aioLock);
+    if(handle < 0 || handle >= disk->aioCap || !disk->aio[handle].used
+        || disk->aio[handle].claimed){
+        pthread_mutex_unlock(&disk->aioLock);
+        return -1;
+    }
+
+    //aioLock is dropped while we reap, fs_aio_poll
+    //must not collect the request meanwhile
+    disk->aio[handle].claimed = true;
+    while(!disk->aio[handle].done){
+        if(reap_aio(disk, true) < 0){
+            disk->aio[handle].claimed = false;
+            pthread_mutex_unlock(&disk->aioLock);
+            return -1;
+        }
+    }
+
+    fs_aio_cb callback = disk->aio[handle].callback;
+    void *arg = disk->aio[handle].arg;
+    int result = disk->aio[handle].result;
+    put_aio_handle(disk, handle);
+    pthread_mutex_unlock(&disk->aioLock);
+    if(callback)
+        callback(handle, result, arg);
+    return result;
+}
+
+/*
+ * The fs_* functions work on defaultDisk,
+ * the file system mounted by fs_mount
+ */
+int fs_mount(const char *diskname)
+{
+    if(defaultDisk)
+        return -1;
+    defaultDisk = fsi_mount(diskname);
+    return defaultDisk ? 0 : -1;
+}
+
+int fs_umount(void)
+{
+    if(fsi_umount(defaultDisk))
+        return -1;
+    defaultDisk = NULL;
+    return 0;
+}
+
+int fs_info(void)
+{
+    return fsi_info(defaultDisk);
+}
+
+int fs_sync(void)
+{
+    return fsi_sync(defaultDisk);
+}
+
+int fs_create(const char *filename)
+{
+    return fsi_create(defaultDisk, filename);
+}
+
+int fs_delete(const char *filename)
+{
+    return fsi_delete(defaultDisk, filename);
+}
+
+int fs_ls(void)
+{
+    return fsi_ls(defaultDisk);
+}
+
+int fs_open(const char *filename)
+{
+    return fsi_open(defaultDisk, filename);
+}
+
+int fs_open_name(const char *filename, size_t len)
+{
+    return fsi_open_name(defaultDisk, filename, len);
+}
+
+int fs_close(int fd)
+{
+    return fsi_close(defaultDisk, fd);
+}
+
+int fs_stat(int fd)
+{
+    return fsi_stat(defaultDisk, fd);
+}
+
+int fs_size(int fd, size_t *size)
+{
+    return fsi_size(defaultDisk, fd, size);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+    return fsi_lseek(defaultDisk, fd, offset);
+}
+
+int fs_set_write_buffer(int fd, int enable)
+{
+    return fsi_set_write_buffer(defaultDisk, fd, enable);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+    return fsi_write(defaultDisk, fd, buf, count);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+    return fsi_read(defaultDisk, fd, buf, count);
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+    return fsi_pwrite(defaultDisk, fd, buf, count, offset);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+    return fsi_pread(defaultDisk, fd, buf, count, offset);
+}
+
+int fs_read_view(int fd, size_t count, struct fs_span *spans, size_t nspans)
+{
+    return fsi_read_view(defaultDisk, fd, count, spans, nspans);
+}
+
+int fs_release_view(struct fs_span *spans, size_t nspans)
+{
+    return fsi_release_view(defaultDisk, spans, nspans);
+}
+
+int fs_aio_write(int fd, void *buf, size_t count, fs_aio_cb callback, void *arg)
+{
+    return fsi_aio_write(defaultDisk, fd, buf, count, callback, arg);
+}
+
+int fs_aio_read(int fd, void *buf, size_t count, fs_aio_cb callback, void *arg)
+{
+    return fsi_aio_read(defaultDisk, fd, buf, count, callback, arg);
+}
+
+int fs_aio_poll(void)
+{
+    return fsi_aio_poll(defaultDisk);
+}
+
+int fs_aio_wait(int handle)
+{
+    return fsi_aio_wait(defaultDisk, handle);
+}
@@ -3,14 +3,48 @@
 
 #include <stddef.h> /* for size_t definition */
 
-/** Maximum filename length (including the NULL character) */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The sizes below are fixed when the library is built and can be changed on
+ * the make command line, e.g. `make FS_BLOCK_SIZE=65536`. Programs must be
+ * built with the same values as the library.
+ */
+
+/**
+ * Size of a disk block in bytes, a power of two of at least 512. fs_format()
+ * records it in the superblock and fs_mount() refuses disks formatted with
+ * another block size. Legacy disks have 4096-byte blocks.
+ */
+#ifndef FS_BLOCK_SIZE
+#define FS_BLOCK_SIZE 4096
+#endif
+
+/**
+ * Maximum filename length (including the NULL character). A root directory
+ * entry takes %FS_FILENAME_LEN + 16 bytes, which must divide %FS_BLOCK_SIZE.
+ * It is recorded in the superblock like the block size. Legacy disks and disks
+ * with 16-bit block indices have 16-byte filenames.
+ */
+#ifndef FS_FILENAME_LEN
 #define FS_FILENAME_LEN 16
+#endif
 
-/** Maximum number of files in the root directory */
-#define FS_FILE_MAX_COUNT 128
+/**
+ * Maximum number of files in a single-block root directory, which is the
+ * legacy layout. Disks formatted by fs_format() can hold more.
+ */
+#define FS_FILE_MAX_COUNT (FS_BLOCK_SIZE / (FS_FILENAME_LEN + 16))
 
-/** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
+/**
+ * Maximum number of open files, a multiple of 64. The file descriptor table
+ * grows up to it as files are opened.
+ */
+#ifndef FS_OPEN_MAX_COUNT
+#define FS_OPEN_MAX_COUNT 65536
+#endif
 
 /**
  * fs_mount - Mount a file system
@@ -20,6 +54,12 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Once mounted, the file system can be used from several threads at once:
+ * reads of any files run in parallel, writes to a file exclude other
+ * operations on that file only. Operations on the same file descriptor are
+ * serialized. fs_mount(), fs_umount() and the fs_set_*() functions must not
+ * run concurrently with any other call.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -33,9 +73,92 @@ int fs_mount(const char *diskname);
  *
  * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
  * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+ * If the virtual disk reports an error while it is closed, its data may not
+ * have reached the file, and calling fs_umount() again only frees the rest.
  */
 int fs_umount(void);
 
+/**
+ * fs_format - Create an empty file system on a virtual disk
+ * @diskname: Name of the virtual disk file
+ * @nfiles: Number of files the root directory must be able to hold
+ *
+ * Erase the existing virtual disk file @diskname and create an empty file
+ * system spanning the whole file. The root directory takes as many blocks as
+ * needed for @nfiles files, and the remaining blocks hold data. Disks of more
+ * than 65535 blocks get 32-bit block indices and 64-bit file sizes. The disk
+ * must not be mounted. fs_mount() accepts both these disks and the legacy layout
+ * with a one-block root directory.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if it is too
+ * small or too large for the requested layout. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t nfiles);
+
+/**
+ * fs_set_cache_size - Set size of the buffer cache
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Set the capacity of the buffer cache that fs_mount() creates for the next
+ * mounted file system. Data blocks written with fs_write() are kept in the
+ * cache and only reach the disk when they get evicted, on fs_sync() or on
+ * fs_umount(). A capacity of 0 disables the cache.
+ *
+ * Return: -1 if a file system is currently mounted. 0 otherwise.
+ */
+int fs_set_cache_size(size_t nblocks);
+
+/** Allocation policies for fs_set_alloc_mode() */
+#define FS_ALLOC_NEXT_FIT 0
+#define FS_ALLOC_EXTENT 1
+
+/**
+ * fs_set_alloc_mode - Choose how new blocks are allocated
+ * @mode: %FS_ALLOC_NEXT_FIT or %FS_ALLOC_EXTENT
+ *
+ * With %FS_ALLOC_NEXT_FIT (default), a growing file takes the next free blocks
+ * after the last allocation. With %FS_ALLOC_EXTENT, fs_write() looks for a run
+ * of free blocks that holds the whole extension (best-fit) so that large files
+ * are laid out contiguously on disk.
+ *
+ * Return: -1 if @mode is invalid. 0 otherwise.
+ */
+int fs_set_alloc_mode(int mode);
+
+/** Metadata commit policies for fs_set_meta_mode() */
+#define FS_META_SYNC 0
+#define FS_META_DELAYED 1
+#define FS_META_SYNC_ON_CLOSE 2
+
+/**
+ * fs_set_meta_mode - Choose when metadata is written to disk
+ * @mode: %FS_META_SYNC or %FS_META_DELAYED, optionally or'ed with
+ * %FS_META_SYNC_ON_CLOSE
+ * @maxOps: Number of metadata changes after which delayed metadata is
+ * written anyway, 0 for no limit
+ *
+ * With %FS_META_SYNC (default), fs_create(), fs_delete() and fs_write()
+ * write the root directory and FAT back to disk before returning. With
+ * %FS_META_DELAYED, they are kept in memory until fs_sync(), fs_umount(),
+ * fs_close() if %FS_META_SYNC_ON_CLOSE is set, or until @maxOps changes
+ * piled up.
+ *
+ * Return: -1 if @mode is invalid. 0 otherwise.
+ */
+int fs_set_meta_mode(int mode, size_t maxOps);
+
+/**
+ * fs_sync - Flush file system to disk
+ *
+ * Write all the metadata and data that is buffered in memory back to the
+ * virtual disk, including the write buffers of open file descriptors, and
+ * flush the virtual disk file to stable storage.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if some data could
+ * not be written. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -55,8 +178,9 @@ int fs_info(void);
  * character).
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if string @filename is too long, or if the root directory is already
+ * full. -1 as well if the new entry could not be written to the disk, the file
+ * exists in memory then. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -68,7 +192,8 @@ int fs_create(const char *filename);
  * system.
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * delete, or if file @filename is currently open, or if the change could not
+ * be written to the disk. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
@@ -99,14 +224,29 @@ int fs_ls(void);
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_name - Open a file given the length of its name
+ * @filename: File name, does not need to be null terminated
+ * @len: Length of @filename
+ *
+ * Same as fs_open(), for callers that already know the length of the name.
+ *
+ * Return: -1 if @len is 0 or not less than %FS_FILENAME_LEN, there is no file
+ * named @filename to open, or if there are already %FS_OPEN_MAX_COUNT files
+ * currently open. Otherwise, return the file descriptor.
+ */
+int fs_open_name(const char *filename, size_t len);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Bytes left in its write buffer are written first.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), if asynchronous requests on @fd are not collected yet (@fd stays
+ * open then), or if the disk had no room for buffered bytes (@fd is closed
+ * anyway). 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -117,10 +257,22 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the current size of file.
+ * open), or if the size does not fit in an int. Otherwise return the current
+ * size of file.
  */
 int fs_stat(int fd);
 
+/**
+ * fs_size - Get the size of a file of any size
+ * @fd: File descriptor
+ * @size: Set to the current size of the file
+ *
+ * Like fs_stat(), for files larger than an int can describe.
+ *
+ * Return: -1 if file descriptor @fd is invalid or @size is NULL. 0 otherwise.
+ */
+int fs_size(int fd, size_t *size);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -151,12 +303,35 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * At most %INT_MAX bytes are written by one call.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually written.
+ * open), or if the new size or blocks of the file could not be written to the
+ * disk. Otherwise return the number of bytes actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_set_write_buffer - Buffer small writes of a file descriptor
+ * @fd: File descriptor
+ * @enable: Nonzero to buffer writes, 0 to write them right away (default)
+ *
+ * With a write buffer, fs_write() calls of less than a block on @fd only copy
+ * the data into memory. Consecutive small writes are gathered and written to
+ * the file once they reach the end of a block, so that a stream of small
+ * records costs one block write per block instead of a read-modify-write per
+ * record. The buffer is also written before any other operation on @fd, and
+ * by fs_sync() and fs_close(). Until then, other file descriptors do not see
+ * the buffered bytes. If the disk turns out to have no room for them, the call
+ * that writes them returns -1: fs_sync() and fs_close() report the loss, and
+ * other operations on @fd fail without being done, the file offset of @fd
+ * being left right after the bytes that made it.
+ *
+ * Return: -1 if file descriptor @fd is invalid, or if disabling the buffer
+ * failed to write buffered bytes. 0 otherwise.
+ */
+int fs_set_write_buffer(int fd, int enable);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -172,9 +347,233 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * When the reads of a file descriptor are sequential, the blocks that follow
+ * are prefetched into the buffer cache. The prefetch window grows while the
+ * reads stay sequential, up to a quarter of the cache, and is dropped by any
+ * other access pattern.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: Offset in the file where to start writing
+ *
+ * Same as fs_write(), but the data is written at @offset and the file offset
+ * of @fd is neither used nor changed. @offset can be at most the current size
+ * of the file.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or if @offset is past the end of the file. Otherwise return the number
+ * of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: Offset in the file where to start reading
+ *
+ * Same as fs_read(), but the data is read from @offset and the file offset of
+ * @fd is neither used nor changed. Several threads can read disjoint (or
+ * overlapping) parts of a file through the same file descriptor at once.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or if @offset is past the end of the file. Otherwise return the number
+ * of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/** Piece of a file that is contiguous in memory, see fs_read_view() */
+struct fs_span {
+	const void *data;
+	size_t len;
+};
+
+/**
+ * fs_read_view - Read from a file without copying
+ * @fd: File descriptor
+ * @count: Number of bytes of data to be read
+ * @spans: Array to be filled with the location of the data
+ * @nspans: Number of entries of @spans
+ *
+ * Like fs_read(), but instead of copying the data into a buffer, fill @spans
+ * with pointers to the data inside the virtual disk's memory mapping (see
+ * block_disk_set_backend()), one span per run of blocks that are contiguous
+ * on disk. Stops after @count bytes, at the end of the file, or once @nspans
+ * spans have been filled. The file offset is incremented by the number of
+ * bytes the spans cover.
+ *
+ * The spans stay valid until they are given back with fs_release_view(), and
+ * fs_umount() fails as long as some are not released. Writing to the file
+ * while holding spans changes the data they point to.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the virtual disk is not mapped in memory, or if cached data of
+ * the file could not be written to the disk (no span is taken then, the file
+ * offset is unchanged). Otherwise return the number of spans filled.
+ */
+int fs_read_view(int fd, size_t count, struct fs_span *spans, size_t nspans);
+
+/**
+ * fs_release_view - Release spans of a file
+ * @spans: Spans filled by fs_read_view()
+ * @nspans: Number of spans to release
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if more spans than
+ * currently held are released. 0 otherwise.
+ */
+int fs_release_view(struct fs_span *spans, size_t nspans);
+
+/**
+ * fs_aio_cb - Completion callback of an asynchronous request
+ * @handle: Handle returned when the request was submitted
+ * @result: Number of bytes transferred, or -1 if the transfer failed
+ * @arg: Argument given when the request was submitted
+ */
+typedef void (*fs_aio_cb)(int handle, int result, void *arg);
+
+/**
+ * fs_aio_write - Write to a file asynchronously
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @callback: Function called on completion, can be NULL
+ * @arg: Argument passed to @callback
+ *
+ * Start writing @count bytes of data from buffer @buf into the file referenced
+ * by file descriptor @fd, like fs_write(). The file is extended and the file
+ * offset incremented right away, while data blocks are written in the
+ * background together with other outstanding requests. @buf must stay valid
+ * until the request completes.
+ *
+ * A request completes in fs_aio_poll(), which calls @callback, or in
+ * fs_aio_wait(). Requests without callback must be collected with
+ * fs_aio_wait(). fs_close() of @fd and fs_umount() fail as long as some
+ * requests are not collected. Other operations that access the blocks of the
+ * file right away first wait for its blocks still being written.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return a non-negative handle for the request.
+ */
+int fs_aio_write(int fd, void *buf, size_t count, fs_aio_cb callback,
+		 void *arg);
+
+/**
+ * fs_aio_read - Read from a file asynchronously
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @callback: Function called on completion, can be NULL
+ * @arg: Argument passed to @callback
+ *
+ * Start reading @count bytes of data from the file referenced by file
+ * descriptor @fd into buffer @buf, like fs_read(). The file offset is
+ * incremented right away, the content of @buf is only valid once the request
+ * completed. See fs_aio_write() for completion.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return a non-negative handle for the request.
+ */
+int fs_aio_read(int fd, void *buf, size_t count, fs_aio_cb callback,
+		void *arg);
+
+/**
+ * fs_aio_poll - Complete finished asynchronous requests
+ *
+ * Without blocking, call the callback of every finished request that has one,
+ * and release its handle. Requests a thread waits for in fs_aio_wait() are
+ * left to that thread.
+ *
+ * Return: -1 if no underlying virtual disk was opened. Otherwise return the
+ * number of callbacks called.
+ */
+int fs_aio_poll(void);
+
+/**
+ * fs_aio_wait - Wait for an asynchronous request
+ * @handle: Handle of the request
+ *
+ * Block until request @handle completes, call its callback if it has one, and
+ * release the handle.
+ *
+ * Return: -1 if @handle is invalid, if another thread already waits for it, or
+ * if the transfer failed. Otherwise return the number of bytes transferred.
+ */
+int fs_aio_wait(int handle);
+
+/*
+ * Several file systems can be mounted at the same time through handles. The
+ * fs_*() functions above work on the file system mounted by fs_mount().
+ */
+struct fs_instance;
+
+/**
+ * fsi_mount - Mount a file system and return a handle to it
+ * @diskname: Name of the virtual disk file
+ *
+ * Like fs_mount(), but independent of the file system mounted by fs_mount()
+ * and of other handles. Each handle has its own open file table, buffer cache
+ * and locks. The settings of the fs_set_*() functions are shared.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. Otherwise a handle to pass to the other fsi_*()
+ * functions.
+ */
+struct fs_instance *fsi_mount(const char *diskname);
+
+/**
+ * fsi_umount - Unmount a file system mounted by fsi_mount()
+ * @fs: File system handle, invalid afterwards on success
+ *
+ * Return: -1 if @fs is NULL, or if it cannot be unmounted (see fs_umount()).
+ * 0 otherwise.
+ */
+int fsi_umount(struct fs_instance *fs);
+
+/*
+ * Each of the following does what the fs_*() function of the same name does,
+ * on file system @fs instead of the one mounted by fs_mount(). File
+ * descriptors and asynchronous request handles belong to one file system.
+ */
+int fsi_sync(struct fs_instance *fs);
+int fsi_info(struct fs_instance *fs);
+int fsi_create(struct fs_instance *fs, const char *filename);
+int fsi_delete(struct fs_instance *fs, const char *filename);
+int fsi_ls(struct fs_instance *fs);
+int fsi_open(struct fs_instance *fs, const char *filename);
+int fsi_open_name(struct fs_instance *fs, const char *filename, size_t len);
+int fsi_close(struct fs_instance *fs, int fd);
+int fsi_stat(struct fs_instance *fs, int fd);
+int fsi_size(struct fs_instance *fs, int fd, size_t *size);
+int fsi_lseek(struct fs_instance *fs, int fd, size_t offset);
+int fsi_write(struct fs_instance *fs, int fd, void *buf, size_t count);
+int fsi_set_write_buffer(struct fs_instance *fs, int fd, int enable);
+int fsi_read(struct fs_instance *fs, int fd, void *buf, size_t count);
+int fsi_pwrite(struct fs_instance *fs, int fd, void *buf, size_t count,
+	       size_t offset);
+int fsi_pread(struct fs_instance *fs, int fd, void *buf, size_t count,
+	      size_t offset);
+int fsi_read_view(struct fs_instance *fs, int fd, size_t count,
+		  struct fs_span *spans, size_t nspans);
+int fsi_release_view(struct fs_instance *fs, struct fs_span *spans,
+		     size_t nspans);
+int fsi_aio_write(struct fs_instance *fs, int fd, void *buf, size_t count,
+		  fs_aio_cb callback, void *arg);
+int fsi_aio_read(struct fs_instance *fs, int fd, void *buf, size_t count,
+		 fs_aio_cb callback, void *arg);
+int fsi_aio_poll(struct fs_instance *fs);
+int fsi_aio_wait(struct fs_instance *fs, int handle);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _FS_H */
@@ -0,0 +1,252 @@
+#ifndef _FS_HPP
+#define _FS_HPP
+
+/*
+ * C++17 handles over the fsi_*() functions of fs.h. Mount and File
+ * own a mounted file system and a file descriptor, are move-only and
+ * release them when destroyed. Every member is an inline call of the
+ * C function, errors are reported the same way (-1), nothing is
+ * allocated and no exception is thrown.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#include "fs.h"
+
+namespace libfs {
+
+namespace detail {
+
+/*
+ * copy @name into @buf with its null byte, which the C functions
+ * expect. Return false if it is empty or too long.
+ */
+inline bool c_name(std::string_view name, char (&buf)[FS_FILENAME_LEN]) noexcept
+{
+    if (name.empty() || name.size() >= FS_FILENAME_LEN)
+        return false;
+    std::memcpy(buf, name.data(), name.size());
+    buf[name.size()] = '\0';
+    return true;
+}
+
+//contiguous containers of trivially copyable elements
+template <typename C>
+using element_t = std::remove_pointer_t<decltype(std::data(std::declval<C &>()))>;
+
+template <typename C>
+inline constexpr bool is_bulk_v =
+    std::is_trivially_copyable_v<std::remove_const_t<element_t<C>>>;
+
+} // namespace detail
+
+class File;
+
+/**
+ * Mount - A file system mounted with fsi_mount()
+ *
+ * A default constructed or moved-from Mount holds no file system. The
+ * destructor unmounts, which fails if files are still open: close them first.
+ */
+class Mount {
+public:
+    Mount() noexcept = default;
+    explicit Mount(const char *diskname) noexcept : fs_(fsi_mount(diskname)) {}
+    ~Mount() { umount(); }
+
+    Mount(Mount &&other) noexcept : fs_(std::exchange(other.fs_, nullptr)) {}
+    Mount &operator=(Mount &&other) noexcept
+    {
+        if (this != &other) {
+            umount();
+            fs_ = std::exchange(other.fs_, nullptr);
+        }
+        return *this;
+    }
+    Mount(const Mount &) = delete;
+    Mount &operator=(const Mount &) = delete;
+
+    explicit operator bool() const noexcept { return fs_ != nullptr; }
+    struct fs_instance *get() const noexcept { return fs_; }
+
+    /** Return: -1 if there is no file system or it cannot be unmounted. */
+    int umount() noexcept
+    {
+        if (!fs_ || fsi_umount(fs_))
+            return -1;
+        fs_ = nullptr;
+        return 0;
+    }
+
+    int sync() const noexcept { return fsi_sync(fs_); }
+
+    int create(std::string_view name) const noexcept
+    {
+        char buf[FS_FILENAME_LEN];
+        return detail::c_name(name, buf) ? fsi_create(fs_, buf) : -1;
+    }
+
+    int remove(std::string_view name) const noexcept
+    {
+        char buf[FS_FILENAME_LEN];
+        return detail::c_name(name, buf) ? fsi_delete(fs_, buf) : -1;
+    }
+
+    /** Return: a File that tests false if @name could not be opened. */
+    inline File open(std::string_view name) const noexcept;
+
+private:
+    struct fs_instance *fs_ = nullptr;
+};
+
+/**
+ * File - A file descriptor of a Mount
+ *
+ * A default constructed or moved-from File holds no descriptor. The
+ * destructor closes it, call close() to see whether buffered data made it.
+ */
+class File {
+public:
+    File() noexcept = default;
+    File(struct fs_instance *fs, int fd) noexcept : fs_(fs), fd_(fd) {}
+    ~File() { close(); }
+
+    File(File &&other) noexcept
+        : fs_(other.fs_), fd_(std::exchange(other.fd_, -1)) {}
+    File &operator=(File &&other) noexcept
+    {
+        if (this != &other) {
+            close();
+            fs_ = other.fs_;
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+    File(const File &) = delete;
+    File &operator=(const File &) = delete;
+
+    explicit operator bool() const noexcept { return fd_ >= 0; }
+    int fd() const noexcept { return fd_; }
+
+    /** Return: -1 if there is no descriptor or fsi_close() failed. */
+    int close() noexcept
+    {
+        if (fd_ < 0)
+            return -1;
+        return fsi_close(fs_, std::exchange(fd_, -1));
+    }
+
+    int lseek(std::size_t offset) noexcept { return fsi_lseek(fs_, fd_, offset); }
+    int set_write_buffer(bool enable) noexcept
+    {
+        return fsi_set_write_buffer(fs_, fd_, enable);
+    }
+
+    /** Return: the size of the file, or -1 cast to std::size_t. */
+    std::size_t size() const noexcept
+    {
+        std::size_t size;
+        return fsi_size(fs_, fd_, &size) ? static_cast<std::size_t>(-1) : size;
+    }
+
+    int read(std::byte *buf, std::size_t count) noexcept
+    {
+        return fsi_read(fs_, fd_, buf, count);
+    }
+    int write(const std::byte *buf, std::size_t count) noexcept
+    {
+        return fsi_write(fs_, fd_, const_cast<std::byte *>(buf), count);
+    }
+    int pread(std::byte *buf, std::size_t count, std::size_t offset) noexcept
+    {
+        return fsi_pread(fs_, fd_, buf, count, offset);
+    }
+    int pwrite(const std::byte *buf, std::size_t count, std::size_t offset) noexcept
+    {
+        return fsi_pwrite(fs_, fd_, const_cast<std::byte *>(buf), count, offset);
+    }
+
+#ifdef __cpp_lib_span
+    int read(std::span<std::byte> buf) noexcept
+    {
+        return read(buf.data(), buf.size());
+    }
+    int write(std::span<const std::byte> buf) noexcept
+    {
+        return write(buf.data(), buf.size());
+    }
+    int pread(std::span<std::byte> buf, std::size_t offset) noexcept
+    {
+        return pread(buf.data(), buf.size(), offset);
+    }
+    int pwrite(std::span<const std::byte> buf, std::size_t offset) noexcept
+    {
+        return pwrite(buf.data(), buf.size(), offset);
+    }
+#endif
+
+    /**
+     * read_into - Fill a contiguous container of trivially copyable elements
+     *
+     * Return: the number of whole elements read, or -1.
+     */
+    template <typename C, typename = std::enable_if_t<detail::is_bulk_v<C>>>
+    int read_into(C &out) noexcept
+    {
+        using T = detail::element_t<C>;
+        int ret = read(reinterpret_cast<std::byte *>(std::data(out)),
+                       std::size(out) * sizeof(T));
+        return ret < 0 ? ret : ret / static_cast<int>(sizeof(T));
+    }
+
+    /**
+     * write_from - Write a contiguous container of trivially copyable elements
+     *
+     * Return: the number of whole elements written, or -1.
+     */
+    template <typename C, typename = std::enable_if_t<detail::is_bulk_v<C>>>
+    int write_from(const C &in) noexcept
+    {
+        using T = detail::element_t<const C>;
+        int ret = write(reinterpret_cast<const std::byte *>(std::data(in)),
+                        std::size(in) * sizeof(T));
+        return ret < 0 ? ret : ret / static_cast<int>(sizeof(T));
+    }
+
+    /** Return: 0 if the whole object was read, -1 otherwise. */
+    template <typename T, typename = std::enable_if_t<std::is_trivially_copyable_v<T>>>
+    int read_object(T &out) noexcept
+    {
+        int ret = read(reinterpret_cast<std::byte *>(&out), sizeof(T));
+        return ret == static_cast<int>(sizeof(T)) ? 0 : -1;
+    }
+
+    /** Return: 0 if the whole object was written, -1 otherwise. */
+    template <typename T, typename = std::enable_if_t<std::is_trivially_copyable_v<T>>>
+    int write_object(const T &in) noexcept
+    {
+        int ret = write(reinterpret_cast<const std::byte *>(&in), sizeof(T));
+        return ret == static_cast<int>(sizeof(T)) ? 0 : -1;
+    }
+
+private:
+    struct fs_instance *fs_ = nullptr;
+    int fd_ = -1;
+};
+
+inline File Mount::open(std::string_view name) const noexcept
+{
+    return File(fs_, fsi_open_name(fs_, name.data(), name.size()));
+}
+
+} // namespace libfs
+
+#endif /* _FS_HPP */
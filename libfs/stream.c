@@ -0,0 +1,324 @@
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+#include "stream.h"
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+//what the buffer of a stream holds
+typedef enum bufState{BUF_EMPTY, BUF_READ, BUF_WRITE} bufState;
+
+struct fs_stream{
+    int fd;
+    bool canRead;
+    bool canWrite;
+    //every write goes to the end of the file
+    bool append;
+    bool eof;
+    //allocated on first use, so fs_setvbuf can still resize it
+    char *buf;
+    size_t size;
+    bufState state;
+    //BUF_READ: bytes from pos to len were read ahead.
+    //BUF_WRITE: the first pos bytes wait to be written.
+    size_t pos;
+    size_t len;
+    //offset of the file descriptor
+    size_t offset;
+};
+
+FS_FILE *fs_fopen(const char *filename, const char *mode)
+{
+    if(!mode || (mode[0] != 'r' && mode[0] != 'w' && mode[0] != 'a')
+        || (mode[1] && (mode[1] != '+' || mode[2])))
+        return NULL;
+
+    //there is no truncation, "w" starts over with a new file
+    if(mode[0] == 'w' && fs_create(filename)
+        && (fs_delete(filename) || fs_create(filename)))
+        return NULL;
+    if(mode[0] == 'a')
+        fs_create(filename);
+
+    int fd = fs_open(filename);
+    if(fd < 0)
+        return NULL;
+
+    FS_FILE *stream = calloc(1, sizeof(FS_FILE));
+    if(!stream)
+        die_perror("calloc");
+    stream->fd = fd;
+    stream->canRead = mode[0] == 'r' || mode[1] == '+';
+    stream->canWrite = mode[0] != 'r' || mode[1] == '+';
+    stream->append = mode[0] == 'a';
+    stream->size = FS_STREAM_BUFSIZ;
+    stream->state = BUF_EMPTY;
+
+    if(stream->append && (fs_size(fd, &stream->offset) || fs_lseek(fd, stream->offset))){
+        fs_close(fd);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int fs_setvbuf(FS_FILE *stream, size_t size)
+{
+    if(!size || stream->buf)
+        return -1;
+    stream->size = size;
+    return 0;
+}
+
+/*
+ * allocate the buffer of @stream if it is not there yet
+ */
+void get_stream_buf(FS_FILE *stream)
+{
+    if(stream->buf)
+        return;
+    stream->buf = malloc(stream->size);
+    if(!stream->buf)
+        die_perror("malloc");
+}
+
+/*
+ * write @count bytes to the file descriptor of @stream,
+ * at the end of the file for an append stream
+ * Return: the number of bytes written
+ */
+size_t write_stream_fd(FS_FILE *stream, const char *buf, size_t count)
+{
+    if(stream->append){
+        if(fs_size(stream->fd, &stream->offset) || fs_lseek(stream->fd, stream->offset))
+            return 0;
+    }
+
+    size_t done = 0;
+    while(done < count){
+        int writeByte = fs_write(stream->fd, (void *)(buf + done), count - done);
+        if(writeByte <= 0)
+            break;
+        done += writeByte;
+        stream->offset += writeByte;
+    }
+    return done;
+}
+
+/*
+ * read the next bytes of the file into the buffer of @stream
+ * Return: the number of bytes read, 0 at the end of the file
+ */
+size_t fill_stream_buf(FS_FILE *stream)
+{
+    get_stream_buf(stream);
+    size_t count = stream->size < INT_MAX ? stream->size : INT_MAX;
+    int readByte = fs_read(stream->fd, stream->buf, count);
+    stream->pos = 0;
+    if(readByte <= 0){
+        stream->eof = true;
+        stream->state = BUF_EMPTY;
+        stream->len = 0;
+        return 0;
+    }
+    stream->offset += readByte;
+    stream->state = BUF_READ;
+    stream->len = readByte;
+    return readByte;
+}
+
+int fs_fflush(FS_FILE *stream)
+{
+    int ret = 0;
+    if(stream->state == BUF_WRITE){
+        //bytes that do not fit on the disk are dropped
+        if(write_stream_fd(stream, stream->buf, stream->pos) < stream->pos)
+            ret = -1;
+    } else if(stream->state == BUF_READ && stream->pos < stream->len){
+        //give back what was read ahead
+        size_t offset = stream->offset - (stream->len - stream->pos);
+        if(fs_lseek(stream->fd, offset))
+            return -1;
+        stream->offset = offset;
+    }
+    stream->state = BUF_EMPTY;
+    stream->pos = 0;
+    stream->len = 0;
+    return ret;
+}
+
+int fs_fclose(FS_FILE *stream)
+{
+    int ret = fs_fflush(stream);
+    if(fs_close(stream->fd))
+        ret = -1;
+    free(stream->buf);
+    free(stream);
+    return ret;
+}
+
+int fs_fread(FS_FILE *stream, void *buf, size_t count)
+{
+    if(!stream->canRead)
+        return -1;
+    if(count > INT_MAX)
+        count = INT_MAX;
+    if(stream->state == BUF_WRITE && fs_fflush(stream))
+        return -1;
+
+    size_t done = 0;
+    while(done < count){
+        if(stream->state == BUF_READ && stream->pos < stream->len){
+            size_t opByte = stream->len - stream->pos;
+            if(opByte > count - done)
+                opByte = count - done;
+            memcpy((char *)buf + done, stream->buf + stream->pos, opByte);
+            stream->pos += opByte;
+            done += opByte;
+            continue;
+        }
+
+        //whatever does not fit in the buffer is read right away
+        if(count - done >= stream->size){
+            stream->state = BUF_EMPTY;
+            int readByte = fs_read(stream->fd, (char *)buf + done, count - done);
+            if(readByte <= 0){
+                stream->eof = true;
+                break;
+            }
+            stream->offset += readByte;
+            done += readByte;
+            continue;
+        }
+
+        if(!fill_stream_buf(stream))
+            break;
+    }
+    return done;
+}
+
+int fs_fwrite(FS_FILE *stream, const void *buf, size_t count)
+{
+    if(!stream->canWrite)
+        return -1;
+    if(count > INT_MAX)
+        count = INT_MAX;
+    if(stream->state == BUF_READ && fs_fflush(stream))
+        return -1;
+    get_stream_buf(stream);
+
+    if(count > stream->size - stream->pos){
+        if(fs_fflush(stream))
+            return 0;
+        //too large for the buffer, write it right away
+        if(count >= stream->size)
+            return write_stream_fd(stream, buf, count);
+    }
+
+    memcpy(stream->buf + stream->pos, buf, count);
+    stream->pos += count;
+    if(count)
+        stream->state = BUF_WRITE;
+    return count;
+}
+
+char *fs_fgets(char *s, int size, FS_FILE *stream)
+{
+    if(!stream->canRead || size <= 0)
+        return NULL;
+    if(stream->state == BUF_WRITE && fs_fflush(stream))
+        return NULL;
+
+    size_t done = 0;
+    while(done < (size_t)size - 1){
+        if((stream->state != BUF_READ || stream->pos == stream->len)
+            && !fill_stream_buf(stream))
+            break;
+
+        size_t opByte = stream->len - stream->pos;
+        if(opByte > size - 1 - done)
+            opByte = size - 1 - done;
+        char *newline = memchr(stream->buf + stream->pos, '\n', opByte);
+        if(newline)
+            opByte = newline - (stream->buf + stream->pos) + 1;
+        memcpy(s + done, stream->buf + stream->pos, opByte);
+        stream->pos += opByte;
+        done += opByte;
+        if(newline)
+            break;
+    }
+
+    s[done] = '\0';
+    return done ? s : NULL;
+}
+
+int fs_fputs(const char *s, FS_FILE *stream)
+{
+    size_t len = strlen(s);
+    return fs_fwrite(stream, s, len) == len ? 0 : -1;
+}
+
+int fs_fprintf(FS_FILE *stream, const char *format, ...)
+{
+    if(!stream->canWrite)
+        return -1;
+    if(stream->state == BUF_READ && fs_fflush(stream))
+        return -1;
+    get_stream_buf(stream);
+
+    //format right into the buffer when the output fits
+    va_list ap;
+    va_start(ap, format);
+    size_t room = stream->size - stream->pos;
+    int len = vsnprintf(stream->buf + stream->pos, room, format, ap);
+    va_end(ap);
+    if(len < 0)
+        return -1;
+    if((size_t)len < room){
+        stream->pos += len;
+        stream->state = BUF_WRITE;
+        return len;
+    }
+
+    char *out = malloc(len + 1);
+    if(!out)
+        die_perror("malloc");
+    va_start(ap, format);
+    vsnprintf(out, len + 1, format, ap);
+    va_end(ap);
+    int writeByte = fs_fwrite(stream, out, len);
+    free(out);
+    return writeByte == len ? len : -1;
+}
+
+int fs_fseek(FS_FILE *stream, size_t offset)
+{
+    if(fs_fflush(stream) || fs_lseek(stream->fd, offset))
+        return -1;
+    stream->offset = offset;
+    stream->eof = false;
+    return 0;
+}
+
+size_t fs_ftell(FS_FILE *stream)
+{
+    if(stream->state == BUF_READ)
+        return stream->offset - (stream->len - stream->pos);
+    if(stream->state == BUF_WRITE)
+        return stream->offset + stream->pos;
+    return stream->offset;
+}
+
+int fs_feof(FS_FILE *stream)
+{
+    return stream->eof;
+}
@@ -0,0 +1,158 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stddef.h> /* for size_t definition */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default size of the buffer of a stream */
+#define FS_STREAM_BUFSIZ 4096
+
+/*
+ * Buffered streams over the file descriptors of the mounted
+ * file system, in the spirit of stdio. Small reads and writes
+ * are served from the buffer of the stream and only reach
+ * fs_read() and fs_write() once per buffer. A stream must not
+ * be used by several threads at once.
+ */
+typedef struct fs_stream FS_FILE;
+
+/**
+ * fs_fopen - Open a stream
+ * @filename: File name
+ * @mode: "r" to read, "w" to write from an emptied file, "a" to append, each
+ * optionally followed by "+" to both read and write
+ *
+ * "w" and "a" create the file if it does not exist, "w" deletes and recreates
+ * it otherwise, which fails if it is open elsewhere. Writes of an "a" stream
+ * always go to the end of the file.
+ *
+ * Return: the new stream, or NULL if @mode is invalid or if the file could not
+ * be opened or created.
+ */
+FS_FILE *fs_fopen(const char *filename, const char *mode);
+
+/**
+ * fs_fclose - Close a stream
+ * @stream: Stream
+ *
+ * Buffered data is written first, then the file descriptor of @stream is
+ * closed and @stream is freed.
+ *
+ * Return: -1 if buffered data could not be written or the file descriptor
+ * could not be closed. 0 otherwise.
+ */
+int fs_fclose(FS_FILE *stream);
+
+/**
+ * fs_setvbuf - Set the buffer size of a stream
+ * @stream: Stream
+ * @size: Size of the buffer in bytes, not 0
+ *
+ * Must be called before any other operation on @stream. Streams start with a
+ * buffer of %FS_STREAM_BUFSIZ bytes.
+ *
+ * Return: -1 if @size is 0 or if @stream was already used. 0 otherwise.
+ */
+int fs_setvbuf(FS_FILE *stream, size_t size);
+
+/**
+ * fs_fflush - Write the buffered data of a stream
+ * @stream: Stream
+ *
+ * Data written to @stream is passed to fs_write(). Data read ahead is dropped
+ * and the file offset moves back to the position of @stream.
+ *
+ * Return: -1 if the data could not be written. 0 otherwise.
+ */
+int fs_fflush(FS_FILE *stream);
+
+/**
+ * fs_fread - Read from a stream
+ * @stream: Stream
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ *
+ * Return: -1 if @stream was not opened for reading. Otherwise return the number
+ * of bytes actually read, smaller than @count only at the end of the file.
+ */
+int fs_fread(FS_FILE *stream, void *buf, size_t count);
+
+/**
+ * fs_fwrite - Write to a stream
+ * @stream: Stream
+ * @buf: Data buffer to write
+ * @count: Number of bytes of data to be written
+ *
+ * Return: -1 if @stream was not opened for writing. Otherwise return the
+ * number of bytes actually written, smaller than @count if the disk is full.
+ */
+int fs_fwrite(FS_FILE *stream, const void *buf, size_t count);
+
+/**
+ * fs_fgets - Read a line from a stream
+ * @s: Buffer to be filled with the line
+ * @size: Size of @s
+ * @stream: Stream
+ *
+ * Read at most @size - 1 bytes, stopping after a newline, which is kept. @s is
+ * terminated by a null byte.
+ *
+ * Return: @s, or NULL if nothing was read before the end of the file or if
+ * @stream was not opened for reading.
+ */
+char *fs_fgets(char *s, int size, FS_FILE *stream);
+
+/**
+ * fs_fputs - Write a string to a stream
+ * @s: Null terminated string, written without its null byte
+ * @stream: Stream
+ *
+ * Return: -1 if the whole string could not be written. 0 otherwise.
+ */
+int fs_fputs(const char *s, FS_FILE *stream);
+
+/**
+ * fs_fprintf - Write formatted output to a stream
+ * @stream: Stream
+ * @format: printf() format
+ *
+ * Return: -1 if the whole output could not be written. Otherwise return the
+ * number of bytes written.
+ */
+int fs_fprintf(FS_FILE *stream, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * fs_fseek - Move the position of a stream
+ * @stream: Stream
+ * @offset: New position, from the beginning of the file
+ *
+ * Return: -1 if buffered data could not be written or if @offset is past the
+ * end of the file. 0 otherwise.
+ */
+int fs_fseek(FS_FILE *stream, size_t offset);
+
+/**
+ * fs_ftell - Get the position of a stream
+ * @stream: Stream
+ *
+ * Return: the position of @stream, from the beginning of the file.
+ */
+size_t fs_ftell(FS_FILE *stream);
+
+/**
+ * fs_feof - Check for the end of a stream
+ * @stream: Stream
+ *
+ * Return: 1 if a read of @stream reached the end of the file, 0 otherwise.
+ */
+int fs_feof(FS_FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _STREAM_H */
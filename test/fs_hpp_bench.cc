@@ -0,0 +1,135 @@
+//
+// Compare the C++ handles of fs.hpp with direct calls of the C API
+//
+#include <array>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <string_view>
+
+#include <fs.hpp>
+
+#define ROUNDS 5
+#define RECORDS 4096
+#define RECORD_SIZE 64
+#define OPENS 20000
+
+//operator new calls, the C++ handles must not make any
+static long allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    ++allocations;
+    void *p = std::malloc(size ? size : 1);
+    if (!p)
+        std::abort();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * records written and read back with pwrite/pread,
+ * then the file opened and closed by name
+ */
+static void run_c(struct fs_instance *fs, double *io, double *open)
+{
+    char record[RECORD_SIZE] = {1};
+    int fd = fsi_open(fs, "bench");
+    assert(fd >= 0);
+
+    double start = now();
+    for (int i = 0; i < RECORDS; ++i)
+        assert(fsi_pwrite(fs, fd, record, sizeof(record), i * sizeof(record)) == sizeof(record));
+    for (int i = 0; i < RECORDS; ++i)
+        assert(fsi_pread(fs, fd, record, sizeof(record), i * sizeof(record)) == sizeof(record));
+    *io = (now() - start) / (2 * RECORDS);
+    assert(!fsi_close(fs, fd));
+
+    start = now();
+    for (int i = 0; i < OPENS; ++i) {
+        fd = fsi_open(fs, "bench");
+        assert(fd >= 0 && !fsi_close(fs, fd));
+    }
+    *open = (now() - start) / OPENS;
+}
+
+static void run_cpp(const libfs::Mount &mount, double *io, double *open)
+{
+    std::array<std::byte, RECORD_SIZE> record{std::byte{1}};
+    constexpr std::string_view name = "bench";
+    libfs::File file = mount.open(name);
+    assert(file);
+
+    double start = now();
+    for (int i = 0; i < RECORDS; ++i)
+        assert(file.pwrite(record.data(), record.size(), i * record.size()) == RECORD_SIZE);
+    for (int i = 0; i < RECORDS; ++i)
+        assert(file.pread(record.data(), record.size(), i * record.size()) == RECORD_SIZE);
+    *io = (now() - start) / (2 * RECORDS);
+    assert(!file.close());
+
+    start = now();
+    for (int i = 0; i < OPENS; ++i) {
+        libfs::File f = mount.open(name);
+        assert(f);
+    }
+    *open = (now() - start) / OPENS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <diskname>\n", argv[0]);
+        return 1;
+    }
+
+    libfs::Mount mount(argv[1]);
+    assert(mount && !mount.create("bench"));
+
+    //the bulk helpers round trip whole elements
+    std::array<int, 100> out, in{};
+    for (int i = 0; i < 100; ++i)
+        out[i] = i * i;
+    libfs::File file = mount.open("bench");
+    assert(file.write_from(out) == 100 && !file.lseek(0));
+    assert(file.read_into(in) == 100 && in == out);
+    assert(!file.close() && !mount.open("too-long-filename-here"));
+
+    double cIO = 1e30, cOpen = 1e30, cppIO = 1e30, cppOpen = 1e30;
+    long newCalls = allocations;
+    for (int r = 0; r < ROUNDS; ++r) {
+        double io, open;
+        run_c(mount.get(), &io, &open);
+        cIO = io < cIO ? io : cIO;
+        cOpen = open < cOpen ? open : cOpen;
+        run_cpp(mount, &io, &open);
+        cppIO = io < cppIO ? io : cppIO;
+        cppOpen = open < cppOpen ? open : cppOpen;
+    }
+    assert(allocations == newCalls);
+
+    printf("pread/pwrite of %d bytes: C %.1f ns, C++ %.1f ns\n", RECORD_SIZE, cIO, cppIO);
+    printf("open/close by name: C %.1f ns, C++ %.1f ns\n", cOpen, cppOpen);
+    printf("operator new calls: %ld\n", allocations - newCalls);
+
+    assert(!mount.remove("bench") && !mount.umount());
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <disk.h>
+#include <stream.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -145,6 +146,61 @@ void stest_create_delete()
     printf("Pass: simple test for fs_create and fs_delete.\n");
 }
 
+/*
+ * test cases:
+ * 1, every name resolves after filling the root directory
+ * 2, names stay reachable after scattered deletes
+ * 3, deleted names can be created again
+ * 4, names resolve after remount
+ */
+void stest_name_index(void)
+{
+    char tmp[FS_FILENAME_LEN];
+    fs_mount(diskname);
+
+    //case 1
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+        filename_generator(tmp, i);
+        assert(!fs_create(tmp));
+    }
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+        filename_generator(tmp, i);
+        assert(fs_create(tmp));
+    }
+
+    //case 2
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i += 3) {
+        filename_generator(tmp, i);
+        assert(!fs_delete(tmp));
+    }
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+        filename_generator(tmp, i);
+        int fd = fs_open(tmp);
+        assert((fd < 0) == (i % 3 == 0));
+        if(fd >= 0)
+            assert(!fs_close(fd));
+    }
+
+    //case 3
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i += 3) {
+        filename_generator(tmp, i);
+        assert(!fs_create(tmp));
+    }
+    fs_umount();
+
+    //case 4
+    fs_mount(diskname);
+    for (int i = FS_FILE_MAX_COUNT - 1; i >= 0; --i) {
+        filename_generator(tmp, i);
+        assert(fs_create(tmp));
+        assert(!fs_delete(tmp));
+        assert(fs_delete(tmp));
+    }
+    fs_umount();
+
+    printf("Pass: simple test for filename lookup.\n");
+}
+
 /*
  * test cases:
  * 1, open/close before mount
@@ -219,6 +275,40 @@ void stest_open_close()
     printf("Pass: simple test for fs_open and fs_delete.\n");
 }
 
+/*
+ * test cases:
+ * 1, descriptors freed in several chunks are reused lowest first
+ * 2, the table keeps growing once they are taken again
+ */
+void stest_fd_table(void)
+{
+    int count = 3 * 64 + 10;
+    fs_mount(diskname);
+    fs_create(filenames[0]);
+    for (int i = 0; i < count; ++i)
+        assert(fs_open(filenames[0]) == i);
+
+    //case 1
+    int freed[] = {150, 5, 70, 64};
+    for (int j = 0; j < 4; ++j)
+        assert(!fs_close(freed[j]));
+    assert(fs_delete(filenames[0]));
+    assert(fs_open(filenames[0]) == 5);
+    assert(fs_open(filenames[0]) == 64);
+    assert(fs_open(filenames[0]) == 70);
+    assert(fs_open(filenames[0]) == 150);
+
+    //case 2
+    assert(fs_open(filenames[0]) == count);
+    for (int k = 0; k <= count; ++k)
+        assert(!fs_close(k));
+    assert(fs_close(0));
+    assert(!fs_delete(filenames[0]));
+    fs_umount();
+
+    printf("Pass: simple test for file descriptor table.\n");
+}
+
 /*
  * this is the helping function of stest_read_write
  */
@@ -364,6 +454,894 @@ void stest_lseek(void)
     printf("Pass: simple test for fs_lseek.\n");
 }
 
+/*
+ * this is a helper function for stest_alloc_extent
+ * write @nblock blocks of @pattern into a new file
+ */
+void write_pattern_file(char *filename, size_t nblock, char pattern)
+{
+    char *buf = malloc(nblock * BLOCK_SIZE);
+    memset(buf, pattern, nblock * BLOCK_SIZE);
+
+    assert(!fs_create(filename));
+    int fd = fs_open(filename);
+    assert(fs_write(fd, buf, nblock * BLOCK_SIZE) == nblock * BLOCK_SIZE);
+    assert(!fs_close(fd));
+    free(buf);
+}
+
+/*
+ * this is a helper function for stest_alloc_extent
+ * check that @filename holds @nblock blocks of @pattern
+ */
+void check_pattern_file(char *filename, size_t nblock, char pattern)
+{
+    char *buf = malloc(nblock * BLOCK_SIZE);
+
+    int fd = fs_open(filename);
+    assert(fs_stat(fd) == nblock * BLOCK_SIZE);
+    assert(fs_read(fd, buf, nblock * BLOCK_SIZE) == nblock * BLOCK_SIZE);
+    for (size_t i = 0; i < nblock * BLOCK_SIZE; ++i)
+        assert(buf[i] == pattern);
+    assert(!fs_close(fd));
+    free(buf);
+}
+
+/*
+ * test case:
+ * 1, invalid allocation mode
+ * 2, large write goes to a free run that holds it
+ * 3, small write fills the hole left by a deleted file
+ * 4, append grows a file in place
+ */
+void stest_alloc_extent(void)
+{
+    //case 1
+    assert(fs_set_alloc_mode(-1));
+    assert(!fs_set_alloc_mode(FS_ALLOC_EXTENT));
+
+    fs_mount(diskname);
+
+    write_pattern_file("extent-a", 2, 'a');
+    write_pattern_file("extent-b", 2, 'b');
+    write_pattern_file("extent-c", 2, 'c');
+    assert(!fs_delete("extent-b"));
+
+    //case 2 and 3
+    write_pattern_file("extent-d", 5, 'd');
+    write_pattern_file("extent-e", 2, 'e');
+
+    //case 4
+    int fd = fs_open("extent-a");
+    char buf[BLOCK_SIZE];
+    memset(buf, 'a', BLOCK_SIZE);
+    assert(!fs_lseek(fd, fs_stat(fd)));
+    assert(fs_write(fd, buf, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(!fs_close(fd));
+
+    check_pattern_file("extent-a", 3, 'a');
+    check_pattern_file("extent-c", 2, 'c');
+    check_pattern_file("extent-d", 5, 'd');
+    check_pattern_file("extent-e", 2, 'e');
+
+    assert(!fs_delete("extent-a"));
+    assert(!fs_delete("extent-c"));
+    assert(!fs_delete("extent-d"));
+    assert(!fs_delete("extent-e"));
+    fs_umount();
+    assert(!fs_set_alloc_mode(FS_ALLOC_NEXT_FIT));
+
+    printf("Pass: simple test for extent allocation.\n");
+}
+
+/*
+ * test case:
+ * 1, invalid metadata mode
+ * 2, delayed metadata survives fs_sync and remount
+ * 3, delayed metadata is committed by fs_umount
+ * 4, commit after a number of operations
+ */
+void stest_meta_delayed(void)
+{
+    //case 1
+    assert(fs_set_meta_mode(-1, 0));
+    assert(!fs_set_meta_mode(FS_META_DELAYED, 0));
+
+    //case 2
+    fs_mount(diskname);
+    write_pattern_file("delayed-a", 3, 'a');
+    assert(!fs_sync());
+    fs_umount();
+    fs_mount(diskname);
+    check_pattern_file("delayed-a", 3, 'a');
+
+    //case 3
+    assert(!fs_delete("delayed-a"));
+    write_pattern_file("delayed-b", 2, 'b');
+    fs_umount();
+    fs_mount(diskname);
+    assert(fs_open("delayed-a") == -1);
+    check_pattern_file("delayed-b", 2, 'b');
+    fs_umount();
+
+    //case 4
+    assert(!fs_set_meta_mode(FS_META_DELAYED | FS_META_SYNC_ON_CLOSE, 4));
+    fs_mount(diskname);
+    write_pattern_file("delayed-c", 1, 'c');
+    assert(!fs_delete("delayed-b"));
+    assert(!fs_delete("delayed-c"));
+    fs_umount();
+
+    assert(!fs_set_meta_mode(FS_META_SYNC, 0));
+    printf("Pass: simple test for delayed metadata.\n");
+}
+
+/*
+ * test case:
+ * 1, invalid backend
+ * 2, data written through the mapping survives remount
+ * 3, data written by the default backend is seen through the mapping
+ * 4, read view without mapping
+ * 5, read view sees cached writes and pins the mount
+ */
+void stest_mmap_backend(void)
+{
+    //case 1
+    assert(block_disk_set_backend(-1));
+
+    //case 2
+    assert(!block_disk_set_backend(BLOCK_BACKEND_MMAP));
+    fs_mount(diskname);
+    write_pattern_file("mmap-a", 4, 'm');
+    assert(!fs_sync());
+    fs_umount();
+    fs_mount(diskname);
+    check_pattern_file("mmap-a", 4, 'm');
+    fs_umount();
+
+    //case 3
+    assert(!block_disk_set_backend(BLOCK_BACKEND_PIO));
+    fs_mount(diskname);
+    write_pattern_file("mmap-b", 2, 'p');
+    //case 4
+    int fd = fs_open("mmap-b");
+    struct fs_span span[2];
+    assert(fs_read_view(fd, BLOCK_SIZE, span, 2) == -1);
+    assert(!fs_close(fd));
+    fs_umount();
+    assert(!block_disk_set_backend(BLOCK_BACKEND_MMAP));
+    fs_mount(diskname);
+    check_pattern_file("mmap-b", 2, 'p');
+
+    //case 5
+    fd = fs_open("mmap-a");
+    char buf[BLOCK_SIZE];
+    memset(buf, 'n', BLOCK_SIZE);
+    assert(!fs_lseek(fd, BLOCK_SIZE / 2));
+    assert(fs_write(fd, buf, 10) == 10);
+    assert(!fs_lseek(fd, BLOCK_SIZE / 2));
+    size_t total = 0;
+    int n;
+    while((n = fs_read_view(fd, SIZE_MAX, span, 2)) > 0) {
+        for (int i = 0; i < n; ++i) {
+            const char *data = span[i].data;
+            for (size_t j = 0; j < span[i].len; ++j, ++total)
+                assert(data[j] == (total < 10 ? 'n' : 'm'));
+        }
+        //cannot umount while views are held
+        assert(fs_umount());
+        assert(!fs_release_view(span, n));
+    }
+    assert(total == 4 * BLOCK_SIZE - BLOCK_SIZE / 2);
+    assert(fs_release_view(span, 1));
+    assert(!fs_close(fd));
+
+    assert(!fs_delete("mmap-a"));
+    assert(!fs_delete("mmap-b"));
+    fs_umount();
+
+    assert(!block_disk_set_backend(BLOCK_BACKEND_PIO));
+    printf("Pass: simple test for mmap backend.\n");
+}
+
+/*
+ * this is a helper function for stest_uring_backend
+ * read the first blocks of the disk asynchronously and
+ * compare them with synchronous reads
+ */
+void check_async_read(void)
+{
+    char *buf = malloc(3 * BLOCK_SIZE);
+    char *ref = malloc(3 * BLOCK_SIZE);
+    int tags[2] = {0, 1};
+    struct block_completion done[4];
+
+    assert(!block_queue_read(0, 2, buf, &tags[0]));
+    assert(!block_queue_read(2, 1, buf + 2 * BLOCK_SIZE, &tags[1]));
+    assert(block_queue_read(block_disk_count(), 1, buf, NULL));
+    assert(!block_submit());
+
+    int n = 0;
+    while(n < 2) {
+        int ret = block_complete(done + n, 4 - n, 1);
+        assert(ret > 0);
+        n += ret;
+    }
+    assert(n == 2 && !done[0].result && !done[1].result);
+    assert(done[0].tag != done[1].tag);
+    //nothing left to report
+    assert(block_complete(done, 4, 1) == 0);
+
+    for (int i = 0; i < 3; ++i)
+        assert(!block_read(i, ref + i * BLOCK_SIZE));
+    assert(!memcmp(buf, ref, 3 * BLOCK_SIZE));
+
+    free(buf);
+    free(ref);
+}
+
+/*
+ * test case:
+ * 1, read/write through the ring across fragmented files
+ * 2, asynchronous block requests with io_uring
+ * 3, asynchronous block requests without io_uring
+ */
+void stest_uring_backend(void)
+{
+    //case 1
+    assert(!block_disk_set_backend(BLOCK_BACKEND_URING));
+    fs_mount(diskname);
+    write_pattern_file("uring-a", 3, 'a');
+    write_pattern_file("uring-b", 3, 'b');
+    assert(!fs_delete("uring-a"));
+    write_pattern_file("uring-c", 9, 'c');
+    assert(!fs_sync());
+    check_pattern_file("uring-b", 3, 'b');
+    check_pattern_file("uring-c", 9, 'c');
+
+    fs_umount();
+
+    //case 2
+    assert(!block_disk_open(diskname));
+    check_async_read();
+    assert(!block_disk_close());
+
+    //case 3
+    assert(!block_disk_set_backend(BLOCK_BACKEND_PIO));
+    assert(!block_disk_open(diskname));
+    check_async_read();
+    assert(!block_disk_close());
+    fs_mount(diskname);
+    check_pattern_file("uring-c", 9, 'c');
+    assert(!fs_delete("uring-b"));
+    assert(!fs_delete("uring-c"));
+    fs_umount();
+
+    printf("Pass: simple test for io_uring backend.\n");
+}
+
+/*
+ * this is a helper function for stest_aio
+ * count completed requests and their bytes
+ */
+void count_aio(int handle, int result, void *arg)
+{
+    int *total = arg;
+    assert(result >= 0);
+    total[0] += 1;
+    total[1] += result;
+}
+
+/*
+ * this is a helper function for stest_aio
+ * overlap writes and reads on several files
+ */
+void run_aio(void)
+{
+    int numFile = 3;
+    size_t len = 5 * BLOCK_SIZE + 100;
+    char name[FS_FILENAME_LEN];
+    char *wbuf[numFile], *rbuf[numFile];
+    int fd[numFile], handle[numFile];
+    int total[2] = {0, 0};
+
+    fs_mount(diskname);
+    for (int i = 0; i < numFile; ++i) {
+        sprintf(name, "aio-%d", i);
+        assert(!fs_create(name));
+        fd[i] = fs_open(name);
+        wbuf[i] = malloc(len);
+        rbuf[i] = malloc(len);
+        memset(wbuf[i], 'a' + i, len);
+    }
+
+    //case 1
+    for (int i = 0; i < numFile; ++i)
+        assert(fs_aio_write(fd[i], wbuf[i], len, count_aio, total) >= 0);
+    assert(fs_umount());
+    while(total[0] < numFile)
+        assert(fs_aio_poll() >= 0);
+    assert(total[1] == numFile * len);
+
+    //case 2
+    for (int i = 0; i < numFile; ++i) {
+        assert(!fs_lseek(fd[i], 0));
+        handle[i] = fs_aio_read(fd[i], rbuf[i], len + 1, NULL, NULL);
+        assert(handle[i] >= 0);
+    }
+    for (int i = numFile - 1; i >= 0; --i) {
+        assert(fs_aio_wait(handle[i]) == len);
+        assert(!memcmp(wbuf[i], rbuf[i], len));
+        assert(fs_aio_wait(handle[i]) == -1);
+    }
+
+    //case 3
+    assert(fs_aio_read(-1, rbuf[0], len, NULL, NULL) == -1);
+
+    //case 4
+    size_t late = 4 * BLOCK_SIZE;
+    assert(!fs_create("aio-late"));
+    int lateFd = fs_open("aio-late");
+    int h = fs_aio_write(lateFd, wbuf[0], late, NULL, NULL);
+    assert(h >= 0);
+    //the file stays as long as the writes are not collected
+    assert(fs_close(lateFd) == -1);
+    assert(fs_aio_wait(h) == late);
+    assert(!fs_close(lateFd));
+    assert(!fs_delete("aio-late"));
+    assert(!fs_create("aio-late"));
+    lateFd = fs_open("aio-late");
+    h = fs_aio_write(lateFd, wbuf[0], late, NULL, NULL);
+    assert(h >= 0);
+    assert(fs_pwrite(lateFd, wbuf[1], late, 0) == late);
+    assert(fs_aio_wait(h) == late);
+    assert(fs_pread(lateFd, rbuf[0], late, 0) == late);
+    assert(!memcmp(rbuf[0], wbuf[1], late));
+    assert(!fs_close(lateFd));
+    assert(!fs_delete("aio-late"));
+
+    for (int i = 0; i < numFile; ++i) {
+        assert(!fs_close(fd[i]));
+        sprintf(name, "aio-%d", i);
+        assert(!fs_delete(name));
+        free(wbuf[i]);
+        free(rbuf[i]);
+    }
+    assert(!fs_umount());
+}
+
+/*
+ * test case:
+ * 1, overlapping writes completed by callbacks
+ * 2, overlapping reads collected by fs_aio_wait
+ * 3, invalid fd
+ * 4, a file with writes in flight is not closed or deleted,
+ *    and a write of the same blocks waits for them
+ * all cases run with and without io_uring
+ */
+void stest_aio(void)
+{
+    assert(!block_disk_set_backend(BLOCK_BACKEND_URING));
+    run_aio();
+    assert(!block_disk_set_backend(BLOCK_BACKEND_PIO));
+    run_aio();
+
+    printf("Pass: simple test for asynchronous read and write.\n");
+}
+
+/*
+ * test case:
+ * 1, pread across block boundaries leaves the offset alone
+ * 2, pwrite overwrites and appends without moving the offset
+ * 3, offset past the end of the file, invalid fd
+ */
+void stest_positional(void)
+{
+    fs_mount(diskname);
+    write_pattern_file("positional", 3, 'p');
+    int fd = fs_open("positional");
+    char buf[2 * BLOCK_SIZE];
+
+    //case 1
+    assert(!fs_lseek(fd, 100));
+    assert(fs_pread(fd, buf, BLOCK_SIZE + 200, BLOCK_SIZE - 100) == BLOCK_SIZE + 200);
+    for (int i = 0; i < BLOCK_SIZE + 200; ++i)
+        assert(buf[i] == 'p');
+    assert(fs_pread(fd, buf, BLOCK_SIZE, 3 * BLOCK_SIZE - 10) == 10);
+    assert(fs_pread(fd, buf, BLOCK_SIZE, 3 * BLOCK_SIZE) == 0);
+
+    //case 2
+    memset(buf, 'q', sizeof(buf));
+    assert(fs_pwrite(fd, buf, 300, BLOCK_SIZE - 150) == 300);
+    assert(fs_pwrite(fd, buf, BLOCK_SIZE, 3 * BLOCK_SIZE - 50) == BLOCK_SIZE);
+    assert(fs_stat(fd) == 4 * BLOCK_SIZE - 50);
+    assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+    for (int j = 0; j < sizeof(buf); ++j) {
+        int pos = 100 + j;
+        assert(buf[j] == (pos >= BLOCK_SIZE - 150 && pos < BLOCK_SIZE + 150 ? 'q' : 'p'));
+    }
+
+    //case 3
+    assert(fs_pread(fd, buf, 1, 4 * BLOCK_SIZE) == -1);
+    assert(fs_pwrite(fd, buf, 1, 4 * BLOCK_SIZE) == -1);
+    assert(fs_pread(FS_OPEN_MAX_COUNT, buf, 1, 0) == -1);
+
+    assert(!fs_close(fd));
+    assert(!fs_delete("positional"));
+    fs_umount();
+
+    printf("Pass: simple test for positional read and write.\n");
+}
+
+/*
+ * test cases:
+ * 1, small sequential reads see the data of the file
+ * 2, a write through another fd reaches blocks read ahead
+ * 3, random reads after the window collapsed
+ */
+void stest_read_ahead(void)
+{
+    const size_t nblock = 40;
+    char *data = malloc(nblock * BLOCK_SIZE);
+    for (size_t i = 0; i < nblock * BLOCK_SIZE; ++i)
+        data[i] = (char)(i * 7 + i / BLOCK_SIZE);
+
+    fs_mount(diskname);
+    assert(!fs_create("read-ahead"));
+    int fd = fs_open("read-ahead");
+    assert(fs_write(fd, data, nblock * BLOCK_SIZE) == nblock * BLOCK_SIZE);
+    assert(!fs_lseek(fd, 0));
+
+    //case 1, reads that do not line up with blocks
+    char buf[BLOCK_SIZE / 4 + 24];
+    size_t pos = 0;
+    for (int j = 0; j < 20; ++j) {
+        assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+        assert(!memcmp(buf, data + pos, sizeof(buf)));
+        pos += sizeof(buf);
+    }
+
+    //case 2
+    int other = fs_open("read-ahead");
+    memset(data + pos, 'w', 3 * BLOCK_SIZE);
+    assert(!fs_lseek(other, pos));
+    assert(fs_write(other, data + pos, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE);
+    assert(!fs_close(other));
+    while(pos < nblock * BLOCK_SIZE){
+        int n = fs_read(fd, buf, sizeof(buf));
+        assert(n > 0 && !memcmp(buf, data + pos, n));
+        pos += n;
+    }
+    assert(fs_read(fd, buf, sizeof(buf)) == 0);
+
+    //case 3
+    for (int j = 0; j < 50; ++j) {
+        pos = (size_t)(j * 7919) % (nblock * BLOCK_SIZE - sizeof(buf));
+        assert(!fs_lseek(fd, pos));
+        assert(fs_read(fd, buf, sizeof(buf)) == sizeof(buf));
+        assert(!memcmp(buf, data + pos, sizeof(buf)));
+    }
+
+    assert(!fs_close(fd));
+    assert(!fs_delete("read-ahead"));
+    fs_umount();
+    free(data);
+
+    printf("Pass: simple test for read-ahead.\n");
+}
+
+/*
+ * test cases:
+ * 1, small writes stay buffered until their block is full
+ * 2, fs_stat, fs_lseek and a large write flush the buffer
+ * 3, overwrite in the middle of the file, fs_close flushes
+ * 4, fs_sync flushes, invalid fd
+ * 5, on a full disk, the call that flushes the buffer fails
+ */
+void stest_write_buffer(void)
+{
+    //45 records fill a bit more than a block
+    char record[BLOCK_SIZE / 40];
+    const size_t rec = sizeof(record);
+    const size_t total = 45 * rec;
+    char buf[3 * BLOCK_SIZE];
+    size_t stat;
+
+    fs_mount(diskname);
+    assert(!fs_create("buffered"));
+    int fd = fs_open("buffered");
+    int other = fs_open("buffered");
+    assert(!fs_set_write_buffer(fd, 1));
+
+    //case 1
+    for (int j = 0; j < 45; ++j) {
+        memset(record, 'a' + j % 26, rec);
+        assert(fs_write(fd, record, rec) == rec);
+    }
+    assert(!fs_size(other, &stat) && stat == BLOCK_SIZE);
+
+    //case 2
+    assert(fs_stat(fd) == total);
+    assert(!fs_lseek(other, 0));
+    assert(fs_read(other, buf, sizeof(buf)) == total);
+    for (size_t j = 0; j < total; ++j)
+        assert(buf[j] == 'a' + j / rec % 26);
+    assert(fs_write(fd, record, 10) == 10);
+    memset(buf, 'z', BLOCK_SIZE);
+    assert(fs_write(fd, buf, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs_stat(other) == total + 10 + BLOCK_SIZE);
+
+    //case 3
+    assert(!fs_lseek(fd, 50));
+    memset(record, '-', rec);
+    assert(fs_write(fd, record, rec) == rec);
+    assert(!fs_lseek(fd, BLOCK_SIZE - rec / 4));
+    assert(fs_write(fd, record, rec / 2) == rec / 2);
+    assert(!fs_close(fd));
+    assert(!fs_lseek(other, 0));
+    assert(fs_read(other, buf, sizeof(buf)) == total + 10 + BLOCK_SIZE);
+    for (size_t j = 0; j < total + 10 + BLOCK_SIZE; ++j) {
+        char expect = j < total ? 'a' + j / rec % 26 : j < total + 10 ? 's' : 'z';
+        if((j >= 50 && j < 50 + rec) || (j >= BLOCK_SIZE - rec / 4 && j < BLOCK_SIZE - rec / 4 + rec / 2))
+            expect = '-';
+        assert(buf[j] == expect);
+    }
+
+    //case 4
+    assert(!fs_set_write_buffer(other, 1));
+    assert(fs_write(other, record, 10) == 10);
+    assert(!fs_sync());
+    fd = fs_open("buffered");
+    assert(fs_stat(fd) == total + 20 + BLOCK_SIZE);
+    assert(!fs_close(fd));
+    assert(fs_set_write_buffer(fd, 1) == -1);
+    assert(!fs_set_write_buffer(other, 0));
+    assert(!fs_close(other));
+    assert(!fs_delete("buffered"));
+    fs_umount();
+
+    //case 5
+    const char *fullname = "full.fs";
+    fd = open(fullname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, 8 * BLOCK_SIZE))
+        die_perror("ftruncate");
+    close(fd);
+    assert(!fs_format(fullname, 1));
+    struct fs_instance *fs = fsi_mount(fullname);
+    assert(fs && !fsi_create(fs, "full"));
+    fd = fsi_open(fs, "full");
+    while(fsi_write(fs, fd, buf, sizeof(buf)) > 0)
+        ;
+    assert(!fsi_size(fs, fd, &stat) && stat && stat % BLOCK_SIZE == 0);
+    assert(!fsi_set_write_buffer(fs, fd, 1));
+    assert(fsi_write(fs, fd, "hello", 5) == 5);
+    assert(fsi_lseek(fs, fd, 0) == -1);
+    assert(fsi_stat(fs, fd) == (int)stat);
+    assert(fsi_write(fs, fd, "hello", 5) == 5);
+    assert(fsi_write(fs, fd, buf, BLOCK_SIZE) == -1);
+    assert(fsi_write(fs, fd, "hello", 5) == 5);
+    assert(fsi_sync(fs) == -1);
+    assert(fsi_write(fs, fd, "hello", 5) == 5);
+    assert(fsi_close(fs, fd) == -1);
+    assert(!fsi_umount(fs));
+    unlink(fullname);
+
+    printf("Pass: simple test for write buffering.\n");
+}
+
+/*
+ * test cases:
+ * 1, formatted lines written through a small buffer
+ * 2, line reads, including lines longer than the caller buffer
+ * 3, mixed reads, writes and seeks on a "r+" stream
+ * 4, "a" appends, "w" empties the file, invalid modes
+ */
+void stest_stream(void)
+{
+    char line[64];
+
+    fs_mount(diskname);
+
+    //case 1
+    FS_FILE *stream = fs_fopen("stream", "w");
+    assert(stream);
+    assert(!fs_setvbuf(stream, 100));
+    for (int j = 0; j < 500; ++j)
+        assert(fs_fprintf(stream, "record %d\n", j) > 0);
+    assert(fs_setvbuf(stream, 200) == -1);
+    assert(fs_fread(stream, line, 1) == -1);
+    assert(fs_fputs("a line that is longer than the line buffer of the reader\n", stream) == 0);
+    size_t end = fs_ftell(stream);
+    assert(!fs_fclose(stream));
+
+    //case 2
+    stream = fs_fopen("stream", "r");
+    for (int j = 0; j < 500; ++j) {
+        char expect[32];
+        snprintf(expect, sizeof(expect), "record %d\n", j);
+        assert(fs_fgets(line, sizeof(line), stream) == line);
+        assert(!strcmp(line, expect));
+    }
+    assert(fs_fgets(line, 20, stream) && strlen(line) == 19);
+    assert(fs_fgets(line, sizeof(line), stream) && line[strlen(line) - 1] == '\n');
+    assert(fs_ftell(stream) == end);
+    assert(!fs_fgets(line, sizeof(line), stream) && fs_feof(stream));
+    assert(fs_fwrite(stream, line, 1) == -1);
+    assert(!fs_fclose(stream));
+
+    //case 3
+    stream = fs_fopen("stream", "r+");
+    assert(fs_fread(stream, line, 7) == 7 && !memcmp(line, "record ", 7));
+    assert(fs_fwrite(stream, "X", 1) == 1);
+    assert(fs_ftell(stream) == 8);
+    assert(!fs_fseek(stream, 0));
+    assert(fs_fgets(line, sizeof(line), stream) && !strcmp(line, "record X\n"));
+    assert(fs_fgets(line, sizeof(line), stream) && !strcmp(line, "record 1\n"));
+    assert(fs_fseek(stream, end + 1) == -1);
+    assert(!fs_fclose(stream));
+
+    //case 4
+    stream = fs_fopen("stream", "a");
+    assert(fs_fputs("tail\n", stream) == 0);
+    assert(!fs_fclose(stream));
+    int fd = fs_open("stream");
+    assert(fs_stat(fd) == end + 5);
+    assert(!fs_lseek(fd, end));
+    assert(fs_read(fd, line, sizeof(line)) == 5 && !memcmp(line, "tail\n", 5));
+    assert(!fs_close(fd));
+    stream = fs_fopen("stream", "w+");
+    assert(!fs_fgets(line, sizeof(line), stream));
+    assert(!fs_fclose(stream));
+    assert(!fs_fopen("stream", "rw") && !fs_fopen("missing", "r"));
+    assert(!fs_delete("stream"));
+    fs_umount();
+
+    printf("Pass: simple test for buffered streams.\n");
+}
+
+/*
+ * this is a helper function for stest_instances
+ * copy the disk image diskname to copyname
+ */
+void copy_disk(const char *copyname)
+{
+    int in = open(diskname, O_RDONLY);
+    int out = open(copyname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(in < 0 || out < 0)
+        die_perror("open");
+    char buf[BLOCK_SIZE];
+    ssize_t n;
+    while((n = read(in, buf, BLOCK_SIZE)) > 0)
+        assert(write(out, buf, n) == n);
+    close(in);
+    close(out);
+}
+
+/*
+ * test cases:
+ * 1, invalid disk and NULL handle
+ * 2, a file created on one instance is not seen by the other
+ * 3, both instances have their own file descriptors
+ * 4, data survives remount of the second instance
+ */
+void stest_instances(void)
+{
+    const char *copyname = "instance-copy.fs";
+    copy_disk(copyname);
+
+    //case 1
+    assert(!fsi_mount("no-such-disk.fs"));
+    assert(fsi_umount(NULL));
+    assert(fsi_info(NULL) == -1);
+
+    //case 2
+    fs_mount(diskname);
+    struct fs_instance *fs = fsi_mount(copyname);
+    assert(fs);
+    write_pattern_file("instance", 2, 'i');
+    assert(fsi_open(fs, "instance") == -1);
+    assert(!fsi_create(fs, "instance"));
+
+    //case 3
+    int fd = fs_open("instance");
+    int fsFd = fsi_open(fs, "instance");
+    assert(fd >= 0 && fsFd >= 0);
+    char buf[BLOCK_SIZE];
+    memset(buf, 'j', BLOCK_SIZE);
+    assert(fsi_write(fs, fsFd, buf, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fsi_stat(fs, fsFd) == BLOCK_SIZE);
+    assert(fs_stat(fd) == 2 * BLOCK_SIZE);
+    assert(!fs_close(fd));
+    assert(!fsi_close(fs, fsFd));
+    //cannot close a descriptor twice
+    assert(fsi_close(fs, fsFd));
+    check_pattern_file("instance", 2, 'i');
+    assert(!fs_delete("instance"));
+    fs_umount();
+
+    //case 4
+    assert(!fsi_umount(fs));
+    fs = fsi_mount(copyname);
+    assert(fs);
+    fsFd = fsi_open(fs, "instance");
+    assert(fsi_read(fs, fsFd, buf, BLOCK_SIZE) == BLOCK_SIZE);
+    for (int i = 0; i < BLOCK_SIZE; ++i)
+        assert(buf[i] == 'j');
+    assert(!fsi_close(fs, fsFd));
+    assert(!fsi_umount(fs));
+    unlink(copyname);
+
+    printf("Pass: simple test for several mounted instances.\n");
+}
+
+/*
+ * test cases:
+ * 1, formatting a missing disk or one too small
+ * 2, a formatted disk holds at least the requested files
+ * 3, content and names survive remount
+ * 4, deleted entries are reused
+ */
+void stest_large_directory(void)
+{
+    const char *copyname = "large-dir.fs";
+    char name[32];
+    int nfiles = 3 * FS_FILE_MAX_COUNT + 1;
+    copy_disk(copyname);
+
+    //case 1
+    assert(fs_format("no-such-disk.fs", nfiles));
+    assert(fs_format(copyname, SIZE_MAX));
+    assert(fs_format(copyname, SIZE_MAX / 32));
+    assert(fs_format(copyname, SIZE_MAX / 16));
+
+    //case 2
+    assert(!fs_format(copyname, nfiles));
+    struct fs_instance *fs = fsi_mount(copyname);
+    assert(fs);
+    int count = 0;
+    for (;; ++count) {
+        snprintf(name, sizeof(name), "large-%d", count);
+        if(fsi_create(fs, name))
+            break;
+    }
+    assert(count >= nfiles && count % FS_FILE_MAX_COUNT == 0);
+    //an entry past the first root directory blocks
+    snprintf(name, sizeof(name), "large-%d", nfiles - 1);
+    int fd = fsi_open(fs, name);
+    assert(fsi_write(fs, fd, "large", 5) == 5);
+    assert(!fsi_close(fs, fd));
+    assert(!fsi_umount(fs));
+
+    //case 3
+    fs = fsi_mount(copyname);
+    assert(fs);
+    char buf[5];
+    fd = fsi_open(fs, name);
+    assert(fsi_read(fs, fd, buf, 5) == 5 && !memcmp(buf, "large", 5));
+    assert(!fsi_close(fs, fd));
+    for (int i = 0; i < count; ++i) {
+        snprintf(name, sizeof(name), "large-%d", i);
+        assert(fsi_create(fs, name));
+    }
+
+    //case 4
+    for (int i = 0; i < count; i += 2) {
+        snprintf(name, sizeof(name), "large-%d", i);
+        assert(!fsi_delete(fs, name));
+    }
+    for (int i = 0; i < count; i += 2) {
+        snprintf(name, sizeof(name), "again-%d", i);
+        assert(!fsi_create(fs, name));
+    }
+    assert(fsi_create(fs, "one-too-many"));
+    assert(!fsi_umount(fs));
+    unlink(copyname);
+
+    printf("Pass: simple test for large root directory.\n");
+}
+
+/*
+ * test cases:
+ * 1, a disk too large for 16-bit indices gets the wide format
+ * 2, data and sizes survive remount
+ * 3, freed blocks are reused
+ */
+void stest_wide_format(void)
+{
+    const char *widename = "wide.fs";
+    size_t nblocks = UINT16_MAX + 100;
+    int fd = open(widename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, nblocks * BLOCK_SIZE))
+        die_perror("ftruncate");
+    close(fd);
+
+    //case 1
+    assert(!fs_format(widename, 1));
+    struct fs_instance *fs = fsi_mount(widename);
+    assert(fs);
+    char *buf = malloc(5 * BLOCK_SIZE);
+    memset(buf, 'w', 5 * BLOCK_SIZE);
+    assert(!fsi_create(fs, "wide"));
+    fd = fsi_open(fs, "wide");
+    assert(fsi_write(fs, fd, buf, 5 * BLOCK_SIZE) == 5 * BLOCK_SIZE);
+    assert(!fsi_close(fs, fd));
+    assert(!fsi_umount(fs));
+
+    //case 2
+    fs = fsi_mount(widename);
+    assert(fs);
+    fd = fsi_open(fs, "wide");
+    size_t size;
+    assert(!fsi_size(fs, fd, &size) && size == 5 * BLOCK_SIZE);
+    memset(buf, 0, 5 * BLOCK_SIZE);
+    assert(fsi_read(fs, fd, buf, 5 * BLOCK_SIZE) == 5 * BLOCK_SIZE);
+    for (int i = 0; i < 5 * BLOCK_SIZE; ++i)
+        assert(buf[i] == 'w');
+    assert(!fsi_close(fs, fd));
+
+    //case 3
+    assert(!fsi_delete(fs, "wide"));
+    assert(!fsi_create(fs, "wide"));
+    fd = fsi_open(fs, "wide");
+    assert(fsi_write(fs, fd, buf, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(!fsi_close(fs, fd));
+    assert(!fsi_delete(fs, "wide"));
+    assert(!fsi_umount(fs));
+    free(buf);
+    unlink(widename);
+
+    printf("Pass: simple test for 32-bit block indices.\n");
+}
+
+/*
+ * this is a helper function for stest_block_size
+ * overwrite byte @offset of the disk image @name
+ */
+void patch_disk(const char *name, off_t offset, uint8_t value)
+{
+    int fd = open(name, O_WRONLY);
+    if(fd < 0 || pwrite(fd, &value, 1, offset) != 1)
+        die_perror("pwrite");
+    close(fd);
+}
+
+/*
+ * test cases:
+ * 1, fs_format records the block size and filename length
+ * 2, disks formatted with another block size or filename length are refused
+ */
+void stest_block_size(void)
+{
+    const char *sizedname = "sized.fs";
+    int fd = open(sizedname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, 100 * BLOCK_SIZE))
+        die_perror("ftruncate");
+    close(fd);
+
+    //case 1
+    assert(!fs_format(sizedname, 10));
+    uint8_t recorded[2];
+    fd = open(sizedname, O_RDONLY);
+    assert(pread(fd, recorded, 2, 40) == 2);
+    close(fd);
+    assert((1 << recorded[0]) == BLOCK_SIZE && recorded[1] == FS_FILENAME_LEN);
+    struct fs_instance *fs = fsi_mount(sizedname);
+    assert(fs && !fsi_umount(fs));
+
+    //case 2
+    patch_disk(sizedname, 40, recorded[0] + 1);
+    assert(!fsi_mount(sizedname));
+    patch_disk(sizedname, 40, recorded[0]);
+    patch_disk(sizedname, 41, FS_FILENAME_LEN + 16);
+    assert(!fsi_mount(sizedname));
+    patch_disk(sizedname, 41, FS_FILENAME_LEN);
+    fs = fsi_mount(sizedname);
+    assert(fs && !fsi_umount(fs));
+    unlink(sizedname);
+
+    printf("Pass: simple test for the recorded block size.\n");
+}
+
 /*
  * this is the simple test of file system
  * in every test cases, we guarantee that
@@ -376,11 +1354,41 @@ void simple_test(void)
 
     stest_create_delete();
 
+    stest_name_index();
+
     stest_open_close();
 
+    stest_fd_table();
+
     stest_read_write_stat();
 
     stest_lseek();
+
+    stest_alloc_extent();
+
+    stest_meta_delayed();
+
+    stest_mmap_backend();
+
+    stest_uring_backend();
+
+    stest_aio();
+
+    stest_positional();
+
+    stest_read_ahead();
+
+    stest_write_buffer();
+
+    stest_stream();
+
+    stest_instances();
+
+    stest_large_directory();
+
+    stest_wide_format();
+
+    stest_block_size();
 }
 
 int main(int argc, char *argv[])
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -271,6 +272,192 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t nfiles;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <nfiles>");
+
+	diskname = t_arg->argv[0];
+	nfiles = get_argv(t_arg->argv[1]);
+
+	if (fs_format(diskname, nfiles))
+		die("Cannot format diskname");
+}
+
+/* Bytes written by each stress thread, not a multiple of the block size */
+#define STRESS_FILE_SIZE (10 * 4096 + 123)
+#define STRESS_MAX_THREADS 16
+
+struct stress_arg {
+	int id;
+	/* Descriptor of the shared file, used by all readers */
+	int shared_fd;
+	int failed;
+};
+
+/* Byte @i of the content of stress file @id */
+static char stress_byte(int id, size_t i)
+{
+	return (char)((i * 31 + id * 7) % 251);
+}
+
+/* Read file @filename back through a new descriptor and check it */
+static int stress_check(const char *filename, int id)
+{
+	char buf[3000];
+	size_t off = 0;
+	int fs_fd, i, read;
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0 || fs_stat(fs_fd) != STRESS_FILE_SIZE)
+		return -1;
+
+	/* Odd sized reads, so that they straddle block boundaries */
+	while ((read = fs_read(fs_fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < read; i++)
+			if (buf[i] != stress_byte(id, off + i))
+				return -1;
+		off += read;
+	}
+
+	if (fs_close(fs_fd) || off != STRESS_FILE_SIZE)
+		return -1;
+	return 0;
+}
+
+/* Write a private file in chunks of varying size, then check it */
+void *stress_writer(void *arg)
+{
+	struct stress_arg *s_arg = arg;
+	char filename[32], buf[5000];
+	size_t off = 0, len;
+	int fs_fd, i;
+
+	snprintf(filename, sizeof(filename), "stress-%d", s_arg->id);
+	if (fs_create(filename) || (fs_fd = fs_open(filename)) < 0) {
+		s_arg->failed = 1;
+		return NULL;
+	}
+
+	while (off < STRESS_FILE_SIZE) {
+		len = 1 + (off * 13 + s_arg->id * 977) % sizeof(buf);
+		if (len > STRESS_FILE_SIZE - off)
+			len = STRESS_FILE_SIZE - off;
+		for (i = 0; i < len; i++)
+			buf[i] = stress_byte(s_arg->id, off + i);
+		if (fs_write(fs_fd, buf, len) != len) {
+			s_arg->failed = 1;
+			break;
+		}
+		off += len;
+	}
+
+	if (fs_close(fs_fd) || stress_check(filename, s_arg->id))
+		s_arg->failed = 1;
+	return NULL;
+}
+
+/*
+ * Read the shared file over and over, through a private descriptor and with
+ * positional reads of different ranges through the shared one
+ */
+void *stress_reader(void *arg)
+{
+	struct stress_arg *s_arg = arg;
+	char buf[3000];
+	size_t off, j;
+	int i, read;
+
+	for (i = 0; i < 8; i++) {
+		if (stress_check("stress-shared", -1)) {
+			s_arg->failed = 1;
+			break;
+		}
+
+		off = (i * 4099 + s_arg->id * 1237) % STRESS_FILE_SIZE;
+		read = fs_pread(s_arg->shared_fd, buf, sizeof(buf), off);
+		if (read != (STRESS_FILE_SIZE - off < sizeof(buf) ?
+			     STRESS_FILE_SIZE - off : sizeof(buf))) {
+			s_arg->failed = 1;
+			break;
+		}
+		for (j = 0; j < read; j++)
+			if (buf[j] != stress_byte(-1, off + j))
+				s_arg->failed = 1;
+	}
+	return NULL;
+}
+
+void thread_fs_stress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct stress_arg writers[STRESS_MAX_THREADS];
+	struct stress_arg readers[STRESS_MAX_THREADS];
+	pthread_t wtid[STRESS_MAX_THREADS], rtid[STRESS_MAX_THREADS];
+	char *diskname, *buf;
+	int fs_fd, nthreads = 4, i, failed = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<threads>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		nthreads = get_argv(t_arg->argv[1]);
+	if (nthreads < 1 || nthreads > STRESS_MAX_THREADS)
+		die("threads must be between 1 and %d", STRESS_MAX_THREADS);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* File shared by all readers */
+	buf = malloc(STRESS_FILE_SIZE);
+	if (!buf)
+		die_perror("malloc");
+	for (i = 0; i < STRESS_FILE_SIZE; i++)
+		buf[i] = stress_byte(-1, i);
+	if (fs_create("stress-shared") || (fs_fd = fs_open("stress-shared")) < 0
+	    || fs_write(fs_fd, buf, STRESS_FILE_SIZE) != STRESS_FILE_SIZE) {
+		fs_umount();
+		die("Cannot write shared file");
+	}
+	free(buf);
+
+	/* Writers of different files and readers of the same one at once */
+	for (i = 0; i < nthreads; i++) {
+		writers[i].id = i;
+		writers[i].failed = 0;
+		readers[i].id = i;
+		readers[i].shared_fd = fs_fd;
+		readers[i].failed = 0;
+		if (pthread_create(&wtid[i], NULL, stress_writer, &writers[i])
+		    || pthread_create(&rtid[i], NULL, stress_reader, &readers[i]))
+			die("Cannot create thread");
+	}
+	for (i = 0; i < nthreads; i++) {
+		char filename[32];
+
+		pthread_join(wtid[i], NULL);
+		pthread_join(rtid[i], NULL);
+		failed |= writers[i].failed | readers[i].failed;
+		snprintf(filename, sizeof(filename), "stress-%d", i);
+		fs_delete(filename);
+	}
+	fs_close(fs_fd);
+	fs_delete("stress-shared");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	if (failed)
+		die("Stress test failed");
+
+	printf("Stress test with %d writers and %d readers passed\n",
+	       nthreads, nthreads);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -280,7 +467,9 @@ static struct {
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat }
+	{ "stat",	thread_fs_stat },
+	{ "format",	thread_fs_format },
+	{ "stress",	thread_fs_stress }
 };
 
 void usage(char *program)